@@ -0,0 +1,334 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * AF_PACKET backend of af_xdp_user (--af-packet): the same handlers on a
+ * TPACKET_V3 RX ring, to measure what AF_XDP gains on a given kernel and
+ * driver, or to run where XDP isn't available. The kernel copies every
+ * packet into the ring, and the handler's TX and FWD packets are copied
+ * again by sendmmsg().
+ */
+
+#define _GNU_SOURCE /* sendmmsg() */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+#include "af_xdp_user.h"
+
+/* TPACKET_V3 ring blocks. A block goes to user space when full, or after
+ * PKT_BLOCK_TIMEOUT ms.
+ */
+#define PKT_BLOCK_SIZE     (1 << 20)
+#define PKT_BLOCK_TIMEOUT  1
+
+/* Since kernel v4.20 */
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+void pkt_close_socket(struct xsk_socket_info *xsk)
+{
+	if (xsk->pkt_ring)
+		munmap(xsk->pkt_ring, (size_t)xsk->pkt_block_nr * PKT_BLOCK_SIZE);
+	if (xsk->pkt_fd >= 0)
+		close(xsk->pkt_fd);
+	free(xsk);
+}
+
+/* With fanout_id >= 0, the sockets of a device with the same id share its
+ * traffic by flow hash, which is what RSS does for the AF_XDP sockets.
+ */
+struct xsk_socket_info *pkt_configure_socket(const char *ifname, int ifindex,
+					     int queue_id, int fanout_id)
+{
+	struct xsk_socket_info *xsk;
+	struct tpacket_req3 req;
+	struct sockaddr_ll addr;
+	int opt, err;
+
+	xsk = aligned_alloc(CACHE_LINE_SIZE, sizeof(*xsk));
+	if (!xsk)
+		return NULL;
+	memset(xsk, 0, sizeof(*xsk));
+	xsk->ifname = ifname;
+	xsk->ifindex = ifindex;
+	xsk->queue_id = queue_id;
+	xsk->cpu = -1;
+
+	/* No protocol until bind(), so nothing arrives before the ring */
+	xsk->pkt_fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (xsk->pkt_fd < 0)
+		goto error;
+
+	opt = TPACKET_V3;
+	if (setsockopt(xsk->pkt_fd, SOL_PACKET, PACKET_VERSION,
+		       &opt, sizeof(opt)) < 0)
+		goto error;
+
+	/* As much memory as the UMEM of an AF_XDP socket */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = PKT_BLOCK_SIZE;
+	req.tp_block_nr = (uint64_t)cfg.xsk_frames * cfg.xsk_frame_size /
+			  PKT_BLOCK_SIZE;
+	if (req.tp_block_nr < 2)
+		req.tp_block_nr = 2;
+	req.tp_frame_size = cfg.xsk_frame_size;
+	req.tp_frame_nr = req.tp_block_nr * (PKT_BLOCK_SIZE / req.tp_frame_size);
+	req.tp_retire_blk_tov = PKT_BLOCK_TIMEOUT;
+	req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+	if (setsockopt(xsk->pkt_fd, SOL_PACKET, PACKET_RX_RING,
+		       &req, sizeof(req)) < 0)
+		goto error;
+
+	xsk->pkt_ring = mmap(NULL, (size_t)req.tp_block_nr * PKT_BLOCK_SIZE,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     xsk->pkt_fd, 0);
+	if (xsk->pkt_ring == MAP_FAILED) {
+		xsk->pkt_ring = NULL;
+		goto error;
+	}
+	xsk->pkt_block_nr = req.tp_block_nr;
+
+	/* Send straight to the driver like AF_XDP does, and don't see our
+	 * own packets again. Both are only optimizations. */
+	opt = 1;
+	setsockopt(xsk->pkt_fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+		   &opt, sizeof(opt));
+	setsockopt(xsk->pkt_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+		   &opt, sizeof(opt));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifindex;
+	if (bind(xsk->pkt_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto error;
+
+	if (fanout_id >= 0) {
+		opt = fanout_id | PACKET_FANOUT_HASH << 16;
+		if (setsockopt(xsk->pkt_fd, SOL_PACKET, PACKET_FANOUT,
+			       &opt, sizeof(opt)) < 0)
+			goto error;
+	}
+
+	if (verbose)
+		printf("%s queue %d: AF_PACKET, %u blocks of %u kB\n", ifname,
+		       queue_id, xsk->pkt_block_nr, PKT_BLOCK_SIZE >> 10);
+	return xsk;
+
+error:
+	err = errno;
+	pkt_close_socket(xsk);
+	errno = err;
+	return NULL;
+}
+
+/* The kernel resets these counters on every read */
+static void pkt_update_drops(struct xsk_socket_info *xsk)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	if (!getsockopt(xsk->pkt_fd, SOL_PACKET, PACKET_STATISTICS, &st, &len))
+		stat_add(&xsk->stats.ring_drops, st.tp_drops);
+}
+
+/* Send a batch of packets out of fd with one sendmmsg() call */
+static void pkt_send(struct xsk_socket_info *xsk, int fd,
+		     struct xsk_pkt **pkts, unsigned int n)
+{
+	struct mmsghdr msgs[MAX_BATCH_SIZE];
+	struct iovec iov[MAX_BATCH_SIZE];
+	uint64_t bytes = 0;
+	unsigned int i;
+	int ret;
+
+	if (!n)
+		return;
+
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (i = 0; i < n; i++) {
+		if (pkts[i]->csum_start)
+			pkt_csum_complete(pkts[i]);
+		iov[i].iov_base = pkts[i]->data;
+		iov[i].iov_len = pkts[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* Stops at the first packet the device queue has no room for */
+	ret = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+	stat_add(&xsk->stats.wakeups, 1);
+	if (ret < 0)
+		ret = 0;
+
+	for (i = 0; i < (unsigned int)ret; i++)
+		bytes += iov[i].iov_len;
+	stat_add(&xsk->stats.tx_packets, ret);
+	stat_add(&xsk->stats.tx_bytes, bytes);
+	if ((unsigned int)ret < n)
+		stat_add(&xsk->stats.tx_full_drops, n - ret);
+}
+
+/* Like handle_receive_packets(), for up to n packets from a ring block */
+static void pkt_handle_batch(struct xsk_socket_info *xsk,
+			     struct xsk_pkt *pkts, const uint64_t *t_pkt,
+			     unsigned int n)
+{
+	struct xsk_pkt *out[MAX_BATCH_SIZE];
+	uint64_t bytes = 0, t_rx[MAX_BATCH_SIZE];
+	unsigned int i, nout, nlat = 0;
+	uint32_t target;
+
+	for (i = 0; i < n; i++)
+		bytes += pkts[i].len;
+	stat_add(&xsk->stats.rx_packets, n);
+	stat_add(&xsk->stats.rx_bytes, bytes);
+	stat_add(&xsk->stats.rx_batches[batch_hist_index(n)], 1);
+
+	handler->process(&xsk->handler_ctx, pkts, n);
+
+	for (i = 0, nout = 0; i < n; i++) {
+		if (pkts[i].verdict == XSK_VERDICT_TX) {
+			out[nout++] = &pkts[i];
+			if (verbose)
+				t_rx[nlat++] = t_pkt[i];
+		} else if (pkts[i].verdict == XSK_VERDICT_PASS && pass_fd >= 0) {
+			pass_packet(&pkts[i]);
+		}
+	}
+	pkt_send(xsk, xsk->pkt_fd, out, nout);
+
+	/* One sendmmsg() per FWD target, like fwd_submit() */
+	for (;;) {
+		target = UINT32_MAX;
+		nout = 0;
+		for (i = 0; i < n; i++) {
+			if (pkts[i].verdict != XSK_VERDICT_FWD)
+				continue;
+			if (target == UINT32_MAX)
+				target = pkts[i].fwd_xsk;
+			if (pkts[i].fwd_xsk != target)
+				continue;
+			out[nout++] = &pkts[i];
+			pkts[i].verdict = XSK_VERDICT_DROP;
+			if (verbose && target < (uint32_t)num_xsks)
+				t_rx[nlat++] = t_pkt[i];
+		}
+		if (!nout)
+			break;
+		if (target < (uint32_t)num_xsks)
+			pkt_send(xsk, xsks[target]->pkt_fd, out, nout);
+	}
+
+	lat_record(xsk, t_rx, nlat);
+}
+
+/* Hand the packets of a block to the handler, a batch at a time. The block
+ * stays ours until its status goes back to TP_STATUS_KERNEL.
+ */
+static void pkt_handle_block(struct xsk_socket_info *xsk,
+			     struct tpacket_block_desc *bd)
+{
+	struct xsk_meta metas[MAX_BATCH_SIZE];
+	struct xsk_pkt pkts[MAX_BATCH_SIZE];
+	uint32_t left = bd->hdr.bh1.num_pkts;
+	uint64_t t_rx[MAX_BATCH_SIZE], ts;
+	int64_t mono_offset = 0;
+	struct tpacket3_hdr *hdr;
+	struct timespec now;
+	struct sockaddr_ll *sll;
+	struct xsk_pkt *pkt;
+	unsigned int n;
+
+	/* For the latency histogram, the CLOCK_REALTIME ring timestamps
+	 * moved to the CLOCK_MONOTONIC of gettime() */
+	if (verbose) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		mono_offset = (int64_t)gettime() -
+			((int64_t)now.tv_sec * NANOSEC_PER_SEC + now.tv_nsec);
+	}
+
+	hdr = (struct tpacket3_hdr *)((uint8_t *)bd +
+				      bd->hdr.bh1.offset_to_first_pkt);
+	while (left) {
+		for (n = 0; left && n < cfg.xsk_rx_batch; left--) {
+			sll = (struct sockaddr_ll *)((uint8_t *)hdr +
+				TPACKET_ALIGN(sizeof(*hdr)));
+			if (sll->sll_pkttype == PACKET_OUTGOING)
+				goto next;
+
+			pkt = &pkts[n];
+			memset(pkt, 0, sizeof(*pkt));
+			pkt->data = (uint8_t *)hdr + hdr->tp_mac;
+			pkt->len = hdr->tp_snaplen;
+			pkt->verdict = XSK_VERDICT_DROP;
+
+			/* Software timestamp, CLOCK_REALTIME */
+			ts = (uint64_t)hdr->tp_sec * NANOSEC_PER_SEC +
+			     hdr->tp_nsec;
+			t_rx[n] = ts + mono_offset;
+			if (cfg.xsk_rx_metadata) {
+				metas[n].rx_timestamp = ts;
+				metas[n].rx_hash = hdr->hv1.tp_rxhash;
+				metas[n].rule_id = 0;
+				metas[n].flags = 0;
+				metas[n].pad = 0;
+				pkt->meta = &metas[n];
+			}
+			n++;
+next:
+			hdr = (struct tpacket3_hdr *)((uint8_t *)hdr +
+						      hdr->tp_next_offset);
+		}
+		if (n)
+			pkt_handle_batch(xsk, pkts, t_rx, n);
+	}
+}
+
+void pkt_rx_and_process(struct xsk_socket_info *xsk)
+{
+	struct pollfd fds = {
+		.fd = xsk->pkt_fd,
+		.events = POLLIN | POLLERR,
+	};
+	struct tpacket_block_desc *bd;
+	uint64_t now, next_drops = 0;
+
+	while (worker_running(xsk)) {
+		now = gettime();
+		if (now >= next_drops) {
+			pkt_update_drops(xsk);
+			next_drops = now + NANOSEC_PER_SEC;
+		}
+
+		bd = (struct tpacket_block_desc *)(xsk->pkt_ring +
+			(size_t)xsk->pkt_block * PKT_BLOCK_SIZE);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+				      __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			if (cfg.xsk_poll_mode) {
+				poll(&fds, 1, 1000);
+				stat_add(&xsk->stats.wakeups, 1);
+			}
+			continue;
+		}
+
+		pkt_handle_block(xsk, bd);
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		if (++xsk->pkt_block == xsk->pkt_block_nr)
+			xsk->pkt_block = 0;
+	}
+}
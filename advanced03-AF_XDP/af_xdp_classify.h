@@ -0,0 +1,387 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Batch packet classifier for af_xdp_user handlers.
+ *
+ * xsk_classify() parses a whole batch of packets: Ethernet with up to one
+ * VLAN tag, IPv4 or IPv6, and TCP/UDP ports, and hashes the 5-tuple. On x86,
+ * the plain IPv4 TCP/UDP packets of a batch (no VLAN, no IP options, not a
+ * fragment) are parsed eight at a time with AVX2 gathers, or four at a time
+ * with SSE4.2, using compares instead of a branch per header field. All
+ * other packets take the scalar parser, which gives the same results, so
+ * the hash of a flow doesn't depend on the CPU. The code path is picked
+ * once, with __builtin_cpu_supports().
+ *
+ * IPv6 extension headers are not walked: l4_proto is then the type of the
+ * first extension header, and l4_off points at it.
+ */
+#ifndef __AF_XDP_CLASSIFY_H
+#define __AF_XDP_CLASSIFY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XSK_CLASSIFY_X86
+#endif
+
+#include "af_xdp_handler.h"
+
+struct xsk_pkt_class {
+	uint16_t l3_proto;	/* ETH_P_IP or ETH_P_IPV6, 0 if neither */
+	uint8_t l4_proto;	/* IPPROTO_*, 0 if not IP */
+	uint8_t pad;
+	uint16_t l3_off;	/* Offset of the IP header */
+	uint16_t l4_off;	/* Offset of the L4 header, 0 for fragments */
+	uint32_t hash;		/* 5-tuple hash, 0 if not IP */
+};
+
+enum xsk_classify_impl {
+	XSK_CLASSIFY_SCALAR = 0,
+	XSK_CLASSIFY_SSE42,
+	XSK_CLASSIFY_AVX2,
+};
+
+/* Offsets in a plain IPv4 packet, the case the vector code handles */
+#define XSK_CLS_IP4_OFF		ETH_HLEN
+#define XSK_CLS_L4_OFF		(ETH_HLEN + 20)
+#define XSK_CLS_MIN_LEN		(XSK_CLS_L4_OFF + 4)
+
+#define XSK_CLS_HASH_SEED	0x8a5cd789
+
+static inline uint16_t xsk_cls_load16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t xsk_cls_load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Addresses and ports are hashed as loaded, in network byte order. The
+ * vector code does exactly the same multiplications lane by lane.
+ */
+static inline uint32_t xsk_flow_hash(uint32_t saddr, uint32_t daddr,
+				     uint32_t ports, uint32_t proto)
+{
+	uint32_t h = XSK_CLS_HASH_SEED ^ proto;
+
+	h = (h ^ saddr) * 0x9e3779b1;
+	h = (h ^ daddr) * 0x85ebca77;
+	h = (h ^ ports) * 0xc2b2ae3d;
+	return h ^ (h >> 16);
+}
+
+static inline void xsk_classify_one(const uint8_t *p, uint32_t len,
+				    struct xsk_pkt_class *c)
+{
+	uint32_t off = ETH_HLEN, ihl, saddr, daddr, ports = 0;
+	uint16_t proto, frag;
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	if (len < ETH_HLEN)
+		return;
+
+	proto = xsk_cls_load16(p + 12);
+	if (proto == htons(ETH_P_8021Q) || proto == htons(ETH_P_8021AD)) {
+		if (len < ETH_HLEN + 4)
+			return;
+		proto = xsk_cls_load16(p + 16);
+		off += 4;
+	}
+
+	if (proto == htons(ETH_P_IP)) {
+		if (len < off + 20 || p[off] >> 4 != 4)
+			return;
+		ihl = (p[off] & 0xf) * 4;
+		if (ihl < 20 || len < off + ihl)
+			return;
+
+		c->l4_proto = p[off + 9];
+		saddr = xsk_cls_load32(p + off + 12);
+		daddr = xsk_cls_load32(p + off + 16);
+
+		/* All fragments of a packet get the same hash, only the
+		 * first one has the L4 header */
+		frag = xsk_cls_load16(p + off + 6);
+		if (!(frag & htons(0x1fff)))
+			c->l4_off = off + ihl;
+		if (!(frag & htons(0x3fff)) &&
+		    (c->l4_proto == IPPROTO_TCP || c->l4_proto == IPPROTO_UDP) &&
+		    len >= off + ihl + 4)
+			ports = xsk_cls_load32(p + off + ihl);
+		c->l3_proto = ETH_P_IP;
+	} else if (proto == htons(ETH_P_IPV6)) {
+		if (len < off + 40)
+			return;
+
+		c->l4_proto = p[off + 6];
+		c->l4_off = off + 40;
+		for (i = 0, saddr = 0, daddr = 0; i < 16; i += 4) {
+			saddr ^= xsk_cls_load32(p + off + 8 + i);
+			daddr ^= xsk_cls_load32(p + off + 24 + i);
+		}
+		if ((c->l4_proto == IPPROTO_TCP || c->l4_proto == IPPROTO_UDP) &&
+		    len >= off + 44)
+			ports = xsk_cls_load32(p + off + 40);
+		c->l3_proto = ETH_P_IPV6;
+	} else {
+		return;
+	}
+
+	c->l3_off = off;
+	c->hash = xsk_flow_hash(saddr, daddr, ports, c->l4_proto);
+}
+
+static inline void xsk_classify_scalar(const struct xsk_pkt *pkts,
+				       unsigned int n,
+				       struct xsk_pkt_class *out)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		xsk_classify_one(pkts[i].data, pkts[i].len, &out[i]);
+}
+
+/* Store the vector results of the lanes in mask, scalar parse the rest */
+static inline void xsk_classify_lanes(const struct xsk_pkt *pkts,
+				      unsigned int n, unsigned int mask,
+				      const uint32_t *proto,
+				      const uint32_t *hash,
+				      struct xsk_pkt_class *out)
+{
+	unsigned int j;
+
+	for (j = 0; j < n; j++) {
+		if (!(mask & (1U << j))) {
+			xsk_classify_one(pkts[j].data, pkts[j].len, &out[j]);
+			continue;
+		}
+		out[j].l3_proto = ETH_P_IP;
+		out[j].l4_proto = proto[j];
+		out[j].pad = 0;
+		out[j].l3_off = XSK_CLS_IP4_OFF;
+		out[j].l4_off = XSK_CLS_L4_OFF;
+		out[j].hash = hash[j];
+	}
+}
+
+#ifdef XSK_CLASSIFY_X86
+/* Little-endian views of the header words, as the vector loads see them:
+ * ethertype 0x0800 followed by version 4 and IHL 5, the fragment offset and
+ * MF bit, and the protocol in the top byte of the word at offset 20.
+ */
+#define XSK_CLS_W12_MASK	0x00ffffff
+#define XSK_CLS_W12_IP4		0x00450008
+#define XSK_CLS_W20_FRAG	0x0000ff3f
+
+/* Gather the 32-bit words at offset off of eight packets, only for the
+ * lanes in mask so short packets are not read past their end. The lane
+ * addresses are relative to base, as 64-bit indices.
+ */
+static inline __attribute__((target("avx2")))
+__m256i xsk_cls_gather8(const uint8_t *base, __m256i idx_lo, __m256i idx_hi,
+			__m256i mask, int off)
+{
+	const int *p = (const int *)(base + off);
+	__m128i lo, hi;
+
+	lo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), p, idx_lo,
+					 _mm256_castsi256_si128(mask), 1);
+	hi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), p, idx_hi,
+					 _mm256_extracti128_si256(mask, 1), 1);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+static inline __attribute__((target("avx2")))
+void xsk_classify_avx2(const struct xsk_pkt *pkts, unsigned int n,
+		       struct xsk_pkt_class *out)
+{
+	uint32_t proto[8], hash[8];
+	__m256i idx_lo, idx_hi, len, ok, w12, w20, saddr, daddr, ports;
+	__m256i l4, tcp_udp, h;
+	const uint8_t *base;
+	unsigned int i, mask;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		base = pkts[i].data;
+		idx_lo = _mm256_set_epi64x(pkts[i + 3].data - base,
+					   pkts[i + 2].data - base,
+					   pkts[i + 1].data - base, 0);
+		idx_hi = _mm256_set_epi64x(pkts[i + 7].data - base,
+					   pkts[i + 6].data - base,
+					   pkts[i + 5].data - base,
+					   pkts[i + 4].data - base);
+		len = _mm256_set_epi32(pkts[i + 7].len, pkts[i + 6].len,
+				       pkts[i + 5].len, pkts[i + 4].len,
+				       pkts[i + 3].len, pkts[i + 2].len,
+				       pkts[i + 1].len, pkts[i].len);
+
+		/* Lengths are at most a few frames, a signed compare is fine */
+		ok = _mm256_cmpgt_epi32(len, _mm256_set1_epi32(XSK_CLS_MIN_LEN - 1));
+
+		w12 = xsk_cls_gather8(base, idx_lo, idx_hi, ok, 12);
+		w20 = xsk_cls_gather8(base, idx_lo, idx_hi, ok, 20);
+		saddr = xsk_cls_gather8(base, idx_lo, idx_hi, ok, 26);
+		daddr = xsk_cls_gather8(base, idx_lo, idx_hi, ok, 30);
+		ports = xsk_cls_gather8(base, idx_lo, idx_hi, ok, 34);
+
+		ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(
+			_mm256_and_si256(w12, _mm256_set1_epi32(XSK_CLS_W12_MASK)),
+			_mm256_set1_epi32(XSK_CLS_W12_IP4)));
+		ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(
+			_mm256_and_si256(w20, _mm256_set1_epi32(XSK_CLS_W20_FRAG)),
+			_mm256_setzero_si256()));
+		l4 = _mm256_srli_epi32(w20, 24);
+		tcp_udp = _mm256_or_si256(
+			_mm256_cmpeq_epi32(l4, _mm256_set1_epi32(IPPROTO_TCP)),
+			_mm256_cmpeq_epi32(l4, _mm256_set1_epi32(IPPROTO_UDP)));
+		ok = _mm256_and_si256(ok, tcp_udp);
+
+		h = _mm256_xor_si256(_mm256_set1_epi32(XSK_CLS_HASH_SEED), l4);
+		h = _mm256_mullo_epi32(_mm256_xor_si256(h, saddr),
+				       _mm256_set1_epi32(0x9e3779b1));
+		h = _mm256_mullo_epi32(_mm256_xor_si256(h, daddr),
+				       _mm256_set1_epi32(0x85ebca77));
+		h = _mm256_mullo_epi32(_mm256_xor_si256(h, ports),
+				       _mm256_set1_epi32(0xc2b2ae3d));
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+		_mm256_storeu_si256((__m256i *)proto, l4);
+		_mm256_storeu_si256((__m256i *)hash, h);
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+		xsk_classify_lanes(&pkts[i], 8, mask, proto, hash, &out[i]);
+	}
+
+	xsk_classify_scalar(&pkts[i], n - i, &out[i]);
+}
+
+/* Without gathers, the loads are scalar. Short packets are pointed at a
+ * zero buffer instead of branching, and then fail the ethertype compare.
+ */
+static inline __attribute__((target("sse4.2")))
+void xsk_classify_sse42(const struct xsk_pkt *pkts, unsigned int n,
+			struct xsk_pkt_class *out)
+{
+	static const uint8_t zero_pkt[XSK_CLS_MIN_LEN];
+	uint32_t w12[4], w20[4], sa[4], da[4], po[4], proto[4], hash[4];
+	__m128i ok, w, l4, tcp_udp, h;
+	const uint8_t *p;
+	unsigned int i, j, mask;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		for (j = 0; j < 4; j++) {
+			p = pkts[i + j].len >= XSK_CLS_MIN_LEN ?
+			    pkts[i + j].data : zero_pkt;
+			w12[j] = xsk_cls_load32(p + 12);
+			w20[j] = xsk_cls_load32(p + 20);
+			sa[j] = xsk_cls_load32(p + 26);
+			da[j] = xsk_cls_load32(p + 30);
+			po[j] = xsk_cls_load32(p + 34);
+		}
+
+		w = _mm_loadu_si128((const __m128i *)w12);
+		ok = _mm_cmpeq_epi32(_mm_and_si128(w, _mm_set1_epi32(XSK_CLS_W12_MASK)),
+				     _mm_set1_epi32(XSK_CLS_W12_IP4));
+		w = _mm_loadu_si128((const __m128i *)w20);
+		ok = _mm_and_si128(ok, _mm_cmpeq_epi32(
+			_mm_and_si128(w, _mm_set1_epi32(XSK_CLS_W20_FRAG)),
+			_mm_setzero_si128()));
+		l4 = _mm_srli_epi32(w, 24);
+		tcp_udp = _mm_or_si128(
+			_mm_cmpeq_epi32(l4, _mm_set1_epi32(IPPROTO_TCP)),
+			_mm_cmpeq_epi32(l4, _mm_set1_epi32(IPPROTO_UDP)));
+		ok = _mm_and_si128(ok, tcp_udp);
+
+		h = _mm_xor_si128(_mm_set1_epi32(XSK_CLS_HASH_SEED), l4);
+		h = _mm_mullo_epi32(_mm_xor_si128(h, _mm_loadu_si128((const __m128i *)sa)),
+				    _mm_set1_epi32(0x9e3779b1));
+		h = _mm_mullo_epi32(_mm_xor_si128(h, _mm_loadu_si128((const __m128i *)da)),
+				    _mm_set1_epi32(0x85ebca77));
+		h = _mm_mullo_epi32(_mm_xor_si128(h, _mm_loadu_si128((const __m128i *)po)),
+				    _mm_set1_epi32(0xc2b2ae3d));
+		h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+
+		_mm_storeu_si128((__m128i *)proto, l4);
+		_mm_storeu_si128((__m128i *)hash, h);
+		mask = _mm_movemask_ps(_mm_castsi128_ps(ok));
+		xsk_classify_lanes(&pkts[i], 4, mask, proto, hash, &out[i]);
+	}
+
+	xsk_classify_scalar(&pkts[i], n - i, &out[i]);
+}
+#endif /* XSK_CLASSIFY_X86 */
+
+/* The fastest implementation this CPU has */
+static inline enum xsk_classify_impl xsk_classify_best(void)
+{
+#ifdef XSK_CLASSIFY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return XSK_CLASSIFY_AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return XSK_CLASSIFY_SSE42;
+#endif
+	return XSK_CLASSIFY_SCALAR;
+}
+
+static inline const char *xsk_classify_name(enum xsk_classify_impl impl)
+{
+	switch (impl) {
+	case XSK_CLASSIFY_AVX2:
+		return "avx2";
+	case XSK_CLASSIFY_SSE42:
+		return "sse4.2";
+	default:
+		return "scalar";
+	}
+}
+
+/* Classify with a given implementation, which the CPU must support (see
+ * xsk_classify_best()), e.g. to compare them.
+ */
+static inline void xsk_classify_with(enum xsk_classify_impl impl,
+				     const struct xsk_pkt *pkts, unsigned int n,
+				     struct xsk_pkt_class *out)
+{
+	switch (impl) {
+#ifdef XSK_CLASSIFY_X86
+	case XSK_CLASSIFY_AVX2:
+		xsk_classify_avx2(pkts, n, out);
+		break;
+	case XSK_CLASSIFY_SSE42:
+		xsk_classify_sse42(pkts, n, out);
+		break;
+#endif
+	default:
+		xsk_classify_scalar(pkts, n, out);
+		break;
+	}
+}
+
+/* Fill out[i] for each of the n packets in pkts */
+static inline void xsk_classify(const struct xsk_pkt *pkts, unsigned int n,
+				struct xsk_pkt_class *out)
+{
+	static int impl = -1;
+	int i = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+	if (i < 0) {
+		i = xsk_classify_best();
+		__atomic_store_n(&impl, i, __ATOMIC_RELAXED);
+	}
+	xsk_classify_with(i, pkts, n, out);
+}
+
+#endif /* __AF_XDP_CLASSIFY_H */
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Packet handler API of the af_xdp_user engine.
+ *
+ * A handler is called by each worker thread with the batch of packets it just
+ * received, and sets a verdict per packet. The engine keeps ownership of the
+ * UMEM frames and of all rings: handlers only read and rewrite packet data in
+ * place, and the engine moves the frames to the TX ring of the right socket,
+ * to the kernel, or back to the free pool according to the verdicts.
+ *
+ * Handlers are either built into af_xdp_user, or loaded from a shared object
+ * with --handler <file.so>, which must export a symbol named by
+ * XSK_HANDLER_SYM:
+ *
+ *   const struct xsk_handler xsk_handler = {
+ *           .name    = "my-handler",
+ *           .process = my_process,
+ *   };
+ *
+ * With --multi-buffer, a packet larger than a UMEM frame arrives as a scatter
+ * list: the first buffer in data/len, followed by nr_frags more buffers in
+ * frags[]. Packets are sent out the same way, so handlers that only look at
+ * the headers in the first buffer need no changes.
+ *
+ * A handler that rewrites a packet it sends can leave the TCP or UDP
+ * checksum to the engine, like CHECKSUM_PARTIAL in the kernel: set csum_start
+ * to the offset of the L4 header and csum_offset to that of the checksum
+ * field in it, and put the pseudo header sum in that field, e.g.
+ * ~csum_fold(csum_tcpudp_ipv4(...)) with common/common_csum.h. With
+ * --tx-csum-offload the NIC computes the checksum from the AF_XDP TX
+ * metadata, otherwise the engine does it in software.
+ *
+ * With --af-packet the engine runs the same handlers on an AF_PACKET socket.
+ * Packets then sit back to back in its ring: addr is 0, frame_size is 0, and
+ * a packet can shrink but not grow.
+ */
+#ifndef __AF_XDP_HANDLER_H
+#define __AF_XDP_HANDLER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <linux/types.h>
+
+#include "common_kern_user.h" /* struct xsk_meta */
+
+#define XSK_HANDLER_SYM "xsk_handler"
+
+enum xsk_verdict {
+	XSK_VERDICT_DROP = 0,	/* Return the frame to the free pool */
+	XSK_VERDICT_TX,		/* Send out of the socket it was received on */
+	XSK_VERDICT_FWD,	/* Send out of socket number pkt->fwd_xsk */
+	XSK_VERDICT_PASS,	/* Hand to the kernel stack, via --pass-dev */
+};
+
+/* A further buffer of a multi-buffer packet */
+struct xsk_frag {
+	uint8_t *data;
+	uint32_t len;
+	uint64_t addr;
+};
+
+struct xsk_pkt {
+	uint8_t *data;		/* Packet data in the UMEM, writable */
+	uint32_t len;		/* Can be changed, up to the frame size */
+	uint32_t fwd_xsk;	/* Target socket for XSK_VERDICT_FWD */
+	uint64_t addr;		/* UMEM address, owned by the engine */
+	enum xsk_verdict verdict; /* Set by the handler, DROP on entry */
+	uint32_t nr_frags;	/* Buffers after the first, 0 without SG */
+	struct xsk_frag *frags;
+	const struct xsk_meta *meta; /* With --rx-metadata, else NULL */
+	uint16_t csum_start;	/* Checksum from here on TX, 0 = none */
+	uint16_t csum_offset;	/* Of the checksum field, from csum_start */
+};
+
+static inline uint32_t xsk_pkt_len(const struct xsk_pkt *pkt)
+{
+	uint32_t i, len = pkt->len;
+
+	for (i = 0; i < pkt->nr_frags; i++)
+		len += pkt->frags[i].len;
+	return len;
+}
+
+/* Copy the whole packet into buf, for handlers that need it contiguous.
+ * Returns the packet length, or 0 if it doesn't fit in size bytes.
+ */
+static inline uint32_t xsk_pkt_linearize(const struct xsk_pkt *pkt,
+					 uint8_t *buf, uint32_t size)
+{
+	uint32_t i, off = pkt->len;
+
+	if (xsk_pkt_len(pkt) > size)
+		return 0;
+
+	memcpy(buf, pkt->data, pkt->len);
+	for (i = 0; i < pkt->nr_frags; i++) {
+		memcpy(buf + off, pkt->frags[i].data, pkt->frags[i].len);
+		off += pkt->frags[i].len;
+	}
+	return off;
+}
+
+/* Per-socket context, one per worker */
+struct xsk_handler_ctx {
+	int xsk_index;		/* This socket, 0..num_xsks-1 */
+	int num_xsks;
+	int ifindex;
+	int queue_id;
+	int peer_xsk;		/* Forwarding mode: same queue on the other
+				 * device, otherwise -1 */
+	uint32_t frame_size;	/* 0 with --af-packet */
+	void *priv;		/* Global state returned by init() */
+	void *thread_priv;	/* Free for the handler to use per worker */
+};
+
+struct xsk_handler {
+	const char *name;
+
+	/* Optional, called once before the workers start, with the string
+	 * given by --handler-args (or NULL). Returns 0 or negative errno. */
+	int (*init)(const char *args, void **priv);
+
+	/* Optional, called once after the workers have stopped */
+	void (*fini)(void *priv);
+
+	/* Called concurrently from all workers, each with its own ctx */
+	void (*process)(struct xsk_handler_ctx *ctx,
+			struct xsk_pkt *pkts, unsigned int n);
+};
+
+#endif /* __AF_XDP_HANDLER_H */
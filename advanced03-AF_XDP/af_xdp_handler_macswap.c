@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Example af_xdp_user packet handler: reflect every packet back out of the
+ * port it came in on, with source and destination MAC swapped.
+ *
+ *  $ sudo ./af_xdp_user -d <ifname> --handler ./af_xdp_handler_macswap.so
+ */
+#include <string.h>
+#include <linux/if_ether.h>
+
+#include "af_xdp_handler.h"
+
+static void macswap_process(struct xsk_handler_ctx *ctx,
+			    struct xsk_pkt *pkts, unsigned int n)
+{
+	unsigned char tmp[ETH_ALEN];
+	struct ethhdr *eth;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (pkts[i].len < sizeof(*eth))
+			continue; /* Dropped */
+
+		eth = (struct ethhdr *)pkts[i].data;
+		memcpy(tmp, eth->h_dest, ETH_ALEN);
+		memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+		memcpy(eth->h_source, tmp, ETH_ALEN);
+
+		pkts[i].verdict = XSK_VERDICT_TX;
+	}
+}
+
+const struct xsk_handler xsk_handler = {
+	.name    = "macswap",
+	.process = macswap_process,
+};
@@ -1,8 +1,28 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
 #include <linux/bpf.h>
+#include <linux/in.h>
 
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "common_kern_user.h"
+
+/* The kernel's net/xdp.h, only used through a pointer below */
+enum xdp_rss_hash_type {
+	XDP_RSS_TYPE_NONE = 0,
+};
+
+/* XDP metadata kfuncs (kernel v6.3+). They are weak so the program still
+ * loads on kernels without them, and return -EOPNOTSUPP unless the driver
+ * implements them. The kernel only takes a program calling them when it is
+ * bound to the device, hence the two variants of the program below.
+ */
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+					 __u64 *timestamp) __ksym __weak;
+extern int bpf_xdp_metadata_rx_hash(const struct xdp_md *ctx, __u32 *hash,
+				    enum xdp_rss_hash_type *rss_type) __ksym __weak;
 
 struct {
 	__uint(type, BPF_MAP_TYPE_XSKMAP);
@@ -11,33 +31,258 @@ struct {
 	__uint(max_entries, 64);
 } xsks_map SEC(".maps");
 
+/* Steering rules, loaded by af_xdp_user --rules <file> */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct xsk_flow_key);
+	__type(value, struct xsk_rule);
+	__uint(max_entries, XSK_MAX_RULES);
+} xsk_flow_rules SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct xsk_port_key);
+	__type(value, struct xsk_rule);
+	__uint(max_entries, XSK_MAX_RULES);
+} xsk_port_rules SEC(".maps");
+
+/* Filled by af_xdp_user --flow-hash */
 struct {
-	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__type(key, __u32);
-	__type(value, __u32);
-	__uint(max_entries, 64);
-} xdp_stats_map SEC(".maps");
+	__type(value, struct xsk_rss_table);
+	__uint(max_entries, 1);
+} xsk_rss SEC(".maps");
 
-SEC("xdp")
-int xdp_sock_prog(struct xdp_md *ctx)
+/* The rule and hash key of a packet parsed by parse_pkt_meta() */
+static __always_inline void flow_key_from_meta(struct xsk_flow_key *key,
+					       const struct pkt_meta *meta)
+{
+	__builtin_memcpy(key->saddr, meta->saddr, sizeof(key->saddr));
+	__builtin_memcpy(key->daddr, meta->daddr, sizeof(key->daddr));
+	key->sport = meta->sport;
+	key->dport = meta->dport;
+	key->proto = meta->ip_proto;
+}
+
+/* Symmetric, so both directions of a connection go to the same socket */
+static __always_inline __u32 flow_hash(const struct xsk_flow_key *key)
+{
+	__u32 h = 0x8a5cd789 ^ key->proto;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		h = (h ^ key->saddr[i] ^ key->daddr[i]) * 0x9e3779b1;
+	h = (h ^ (key->sport ^ key->dport)) * 0x85ebca77;
+	return h ^ (h >> 16);
+}
+
+/* The flow key of the inner packet of a tunnel, see parse_tunnel(), with the
+ * outer L4 payload at off. A global function, so the verifier checks it once
+ * on its own instead of for every path through the outer headers.
+ */
+__noinline int inner_flow_key(struct xdp_md *ctx, __u32 off, __u32 proto,
+			      __u32 dport, struct xsk_flow_key *key)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct pkt_meta inner = {};
+	struct hdr_cursor nh;
+	struct ethhdr *eth;
+	void *start;
+	int eth_type;
+
+	if (!key)
+		return -1;
+
+	/* The verifier needs the offset bounded, it is below 64K anyway */
+	nh.pos = data + (off & 0x3fff);
+	eth_type = parse_tunnel(&nh, data_end, proto, dport);
+	start = nh.pos;
+	if (eth_type == bpf_htons(ETH_P_TEB))
+		eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (parse_pkt_meta_ip(&nh, start, data_end, eth_type, &inner) < 0)
+		return -1;
+
+	flow_key_from_meta(key, &inner);
+	return 0;
+}
+
+/* The queue whose socket gets a redirected packet: the RX queue, or with a
+ * flow hash table one picked by the hash of the innermost 5-tuple, so the
+ * flows of a single tunnel still spread over all sockets. Fragments go by
+ * their outer addresses only.
+ */
+static __always_inline __u32 rss_queue(struct xdp_md *ctx,
+				       const struct pkt_meta *pkt,
+				       struct xsk_flow_key *flow, __u32 queue)
+{
+	struct xsk_flow_key inner = {}, *key = flow;
+	struct xsk_rss_table *rss;
+	__u32 zero = 0, i;
+
+	rss = bpf_map_lookup_elem(&xsk_rss, &zero);
+	if (!rss || !rss->nr_queues)
+		return queue;
+
+	/* Only the first fragment of a datagram has ports (and a tunnel
+	 * header), so to keep the fragments together they are all hashed on
+	 * the addresses and protocol alone, like NIC RSS does */
+	if (pkt->flags & PKT_META_F_FRAG) {
+		inner = *flow;
+		inner.sport = 0;
+		inner.dport = 0;
+		key = &inner;
+	} else if (!inner_flow_key(ctx, pkt->payload_off, pkt->ip_proto,
+				   pkt->dport, &inner)) {
+		key = &inner;
+	}
+
+	i = flow_hash(key) % rss->nr_queues;
+	if (i >= XSK_RSS_MAX_QUEUES)
+		return queue;
+	return rss->queues[i];
+}
+
+/* A rule limited to a set of queues never applies to the queues above
+ * what queue_mask can hold */
+static __always_inline int rule_on_queue(const struct xsk_rule *rule,
+					 __u32 queue)
+{
+	if (!rule->queue_mask)
+		return 1;
+	return queue < XSK_RULE_MAX_QUEUES &&
+	       (rule->queue_mask & (1ULL << queue));
+}
+
+/* Most specific rule first: exact 5-tuple, protocol and port, protocol */
+static __always_inline struct xsk_rule *lookup_rule(struct xsk_flow_key *flow,
+						    __u32 queue)
+{
+	struct xsk_port_key port = {};
+	struct xsk_rule *rule;
+
+	rule = bpf_map_lookup_elem(&xsk_flow_rules, flow);
+	if (rule && rule_on_queue(rule, queue))
+		return rule;
+
+	port.proto = flow->proto;
+	port.dport = flow->dport;
+	rule = bpf_map_lookup_elem(&xsk_port_rules, &port);
+	if (rule && rule_on_queue(rule, queue))
+		return rule;
+
+	/* Without a port, e.g. ICMP, that was the protocol rule already */
+	if (port.dport) {
+		port.dport = 0;
+		rule = bpf_map_lookup_elem(&xsk_port_rules, &port);
+		if (rule && rule_on_queue(rule, queue))
+			return rule;
+	}
+
+	port.proto = 0;
+	rule = bpf_map_lookup_elem(&xsk_port_rules, &port);
+	if (rule && rule_on_queue(rule, queue))
+		return rule;
+
+	return NULL;
+}
+
+/* Put a struct xsk_meta in front of the packet for user space, with values
+ * from the driver if hw */
+static __always_inline int write_meta(struct xdp_md *ctx, __u32 rule_id,
+				      int hw)
+{
+	enum xdp_rss_hash_type rss_type;
+	struct xsk_meta *meta;
+	__u32 flags = 0, hash;
+	void *data;
+	__u64 ts;
+
+	/* Ask the driver first, these have to be called before the
+	 * metadata area is set up */
+	if (hw && bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp) &&
+	    !bpf_xdp_metadata_rx_timestamp(ctx, &ts))
+		flags |= XSK_META_HW_TIMESTAMP;
+	else
+		ts = bpf_ktime_get_ns();
+
+	if (hw && bpf_ksym_exists(bpf_xdp_metadata_rx_hash) &&
+	    !bpf_xdp_metadata_rx_hash(ctx, &hash, &rss_type))
+		flags |= XSK_META_HW_HASH;
+	else
+		hash = 0;
+
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+		return -1;
+
+	data = (void *)(long)ctx->data;
+	meta = (void *)(long)ctx->data_meta;
+	if (meta + 1 > data)
+		return -1;
+
+	meta->rx_timestamp = ts;
+	meta->rx_hash = hash;
+	meta->rule_id = rule_id;
+	meta->flags = flags;
+	meta->pad = 0;
+	return 0;
+}
+
+static __always_inline int xsk_steer(struct xdp_md *ctx, int hw)
 {
-	int index = ctx->rx_queue_index;
-	__u32 *pkt_count;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct xsk_flow_key flow = {};
+	__u32 index = ctx->rx_queue_index;
+	struct xsk_rule *rule;
+	struct pkt_meta pkt;
+
+	/* Only the flows we have rules for go to user space, everything else
+	 * stays with the kernel without using up AF_XDP frames. The one parse
+	 * here serves the rule lookup and the flow hash. */
+	if (parse_pkt_meta(&nh, data_end, &pkt) < 0)
+		return XDP_PASS;
+	flow_key_from_meta(&flow, &pkt);
+
+	rule = lookup_rule(&flow, index);
+	if (!rule)
+		return XDP_PASS;
+
+	switch (rule->action) {
+	case XSK_RULE_DROP:
+		return XDP_DROP;
+	case XSK_RULE_REDIRECT:
+		index = rss_queue(ctx, &pkt, &flow, index);
 
-	pkt_count = bpf_map_lookup_elem(&xdp_stats_map, &index);
-	if (pkt_count) {
+		/* A set entry here means that the correspnding queue_id
+		 * has an active AF_XDP socket bound to it. */
+		if (!bpf_map_lookup_elem(&xsks_map, &index))
+			return XDP_PASS;
 
-		/* We pass every other packet */
-		if ((*pkt_count)++ & 1)
+		/* User space expects the metadata, without it the packet
+		 * is better off in the kernel */
+		if (write_meta(ctx, rule->rule_id, hw))
+			return XDP_PASS;
+
+		return bpf_redirect_map(&xsks_map, index, XDP_PASS);
+	default:
 		return XDP_PASS;
 	}
+}
 
-	/* A set entry here means that the correspnding queue_id
-	 * has an active AF_XDP socket bound to it. */
-	if (bpf_map_lookup_elem(&xsks_map, &index))
-		return bpf_redirect_map(&xsks_map, index, 0);
+/* af_xdp_user loads xdp_sock_prog, or with --rx-metadata xdp_sock_prog_hw
+ * bound to the device when it can, see dev_bound_possible() there */
+SEC("xdp")
+int xdp_sock_prog(struct xdp_md *ctx)
+{
+	return xsk_steer(ctx, 0);
+}
 
-	return XDP_PASS;
+SEC("xdp")
+int xdp_sock_prog_hw(struct xdp_md *ctx)
+{
+	return xsk_steer(ctx, 1);
 }
 
 char _license[] SEC("license") = "GPL";
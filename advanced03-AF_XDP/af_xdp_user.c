@@ -1,8 +1,13 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+#define _GNU_SOURCE /* CPU_SET() and pthread_attr_setaffinity_np() */
+
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <locale.h>
 #include <poll.h>
 #include <pthread.h>
@@ -13,7 +18,13 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
 
 #include <bpf/bpf.h>
 #include <xdp/xsk.h>
@@ -21,54 +32,158 @@
 
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <netinet/in.h>
 #include <linux/if_link.h>
 #include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/if_tun.h>
+#include <linux/if_packet.h>
+#include <linux/mempolicy.h>
 #include <linux/ipv6.h>
 #include <linux/icmpv6.h>
 
 #include "../common/common_params.h"
 #include "../common/common_user_bpf_xdp.h"
 #include "../common/common_libbpf.h"
+#include "../common/common_csum.h"
+
+#include "common_kern_user.h"
+#include "af_xdp_handler.h"
+#include "af_xdp_classify.h"
+#include "af_xdp_user.h"
 
-#define NUM_FRAMES         4096
+#define NUM_FRAMES         4096 /* Default, per socket */
 #define FRAME_SIZE         XSK_UMEM__DEFAULT_FRAME_SIZE
-#define RX_BATCH_SIZE      64
+#define HUGEPAGE_SIZE      (2 * 1024 * 1024) /* If /proc/meminfo can't tell */
 #define INVALID_UMEM_FRAME UINT64_MAX
+#define BUSY_POLL_USECS    20
+#define DRAIN_TIMEOUT_MS   1000 /* Removing a queue, wait for its TX this long */
+#define DRAIN_QUIET_MS     10   /* and for the kernel to stop delivering RX */
+
+/* Traffic generator (--tx-only) UDP flows, from the RFC 2544 benchmarking
+ * range: 198.18.0.<1 + flow % 254>:<1024 + flow> to 198.19.0.1:9 (discard)
+ */
+#define TX_SRC_IP          0xc6120001
+#define TX_DST_IP          0xc6130001
+#define TX_SRC_PORT        1024
+#define TX_DST_PORT        9
+#define TX_MAX_FLOWS       (65536 - TX_SRC_PORT)
+
+/* Older libc headers lack the busy-poll socket options */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+/* Device bound XDP programs, since kernel v6.3 */
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
+
+/* Nor do older kernel headers know about multi-buffer AF_XDP */
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
+
+/* AF_XDP TX metadata, since kernel v6.8 */
+#ifndef XDP_TX_METADATA
+#define XDP_TX_METADATA (1 << 1)
+#define XDP_TXMD_FLAGS_CHECKSUM (1 << 1)
+
+struct xsk_tx_metadata {
+	__u64 flags;
+	union {
+		struct {
+			__u16 csum_start;
+			__u16 csum_offset;
+		} request;
+		struct {
+			__u64 tx_timestamp;
+		} completion;
+	};
+};
+#endif
+/* Flag to have the UMEM take tx_metadata_len, since kernel v6.11. v6.8 to
+ * v6.10 take it without, and reject the flag. */
+#ifndef XDP_UMEM_TX_METADATA_LEN
+#define XDP_UMEM_TX_METADATA_LEN (1 << 2)
+#endif
 
 static struct xdp_program *prog;
 int xsk_map_fd;
+static struct xdp_program *redirect_prog; /* Forwarding mode, --redirect-dev */
+int redirect_xsk_map_fd;
 bool custom_xsk = false;
+static bool tx_csum_offload; /* UMEMs have room for struct xsk_tx_metadata */
 struct config cfg = {
 	.ifindex   = -1,
+	.xsk_queue_count = 1,
+	.xsk_frames = NUM_FRAMES,
+	.xsk_frame_size = FRAME_SIZE,
+	.xsk_rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	.xsk_tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+	.xsk_fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+	.xsk_comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	.xsk_rx_batch = RX_BATCH_SIZE,
+	.xsk_tx_batch = RX_BATCH_SIZE,
+	.xsk_tx_pkt_size = ETH_ZLEN,
+	.xsk_tx_flows = 1,
+};
+
+/* Global pool of free UMEM frames, shared by all sockets on the UMEM */
+struct xsk_frame_pool {
+	pthread_mutex_t lock;
+	uint64_t *addrs;
+	uint32_t nr_free;
+	uint32_t nr_frames;
 };
 
 struct xsk_umem_info {
+	/* Rings registered together with the UMEM, libxdp hands them over
+	 * to the first socket created on it */
 	struct xsk_ring_prod fq;
 	struct xsk_ring_cons cq;
 	struct xsk_umem *umem;
 	void *buffer;
+	uint64_t size;
+	uint32_t frame_size;
+	/* Of the fill and completion rings of each socket on the UMEM, fixed
+	 * when it is registered. cfg only holds those of new UMEMs. */
+	uint32_t fill_size;
+	uint32_t comp_size;
+	struct xsk_frame_pool pool;
+	int nr_users;
 };
-struct stats_record {
-	uint64_t timestamp;
-	uint64_t rx_packets;
-	uint64_t rx_bytes;
-	uint64_t tx_packets;
-	uint64_t tx_bytes;
-};
-struct xsk_socket_info {
-	struct xsk_ring_cons rx;
-	struct xsk_ring_prod tx;
-	struct xsk_umem_info *umem;
-	struct xsk_socket *xsk;
-
-	uint64_t umem_frame_addr[NUM_FRAMES];
-	uint32_t umem_frame_free;
 
-	uint32_t outstanding_tx;
-
-	struct stats_record stats;
-	struct stats_record prev_stats;
-};
+/* One socket (and worker thread) per configured RX queue. In forwarding
+ * mode the sockets come in pairs, xsks[i ^ 1] is the peer of xsks[i] on the
+ * same queue of the other device.
+ */
+struct xsk_socket_info *xsks[MAX_XSKS];
+int num_xsks;
+
+/* The control socket only changes xsks[] with all workers parked, and with
+ * xsks_lock held against the stats thread. See park_workers().
+ */
+static pthread_mutex_t xsks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static bool park_request;
+static int nr_parked;
+
+static int worker_cpus[MAX_XSKS];
+static int nr_worker_cpus;
+
+const struct xsk_handler *handler;
+static void *handler_dl;
+static void *handler_priv;
+int pass_fd = -1;
 
 static inline __u32 xsk_ring_prod__free(struct xsk_ring_prod *r)
 {
@@ -99,188 +214,737 @@ static const struct option_wrapper long_options[] = {
 	 "Force install, replacing existing program on interface"},
 
 	{{"copy",        no_argument,		NULL, 'c' },
-	 "Force copy mode"},
+	 "Force copy mode, default is zero-copy with fallback to copy"},
 
 	{{"zero-copy",	 no_argument,		NULL, 'z' },
-	 "Force zero-copy mode"},
+	 "Force zero-copy mode, fail if the driver can't do it"},
 
 	{{"queue",	 required_argument,	NULL, 'Q' },
 	 "Configure interface receive queue for AF_XDP, default=0"},
 
+	{{"redirect-dev", required_argument,	NULL, 'r' },
+	 "Forwarding mode: forward frames between --dev and <ifname>",
+	 "<ifname>"},
+
+	{{"fwd-dst-mac", required_argument,	NULL,  33 },
+	 "Forwarding mode: next hop MAC for frames sent out of --dev",
+	 "<mac>"},
+
+	{{"fwd-redirect-dst-mac", required_argument, NULL, 34 },
+	 "Forwarding mode: next hop MAC for frames sent out of --redirect-dev",
+	 "<mac>"},
+
+	{{"dest-mac",	 required_argument,	NULL, 'R' },
+	 "Traffic generator: destination MAC, default broadcast",
+	 "<mac>"},
+
+	{{"queue-count", required_argument,	NULL,  5  },
+	 "Bind one socket and worker per queue, from --queue on, default=1",
+	 "<n>"},
+
+	{{"cpu-list",	 required_argument,	NULL,  6  },
+	 "Pin worker threads to CPUs in <list> (e.g. 2-5,8), round-robin",
+	 "<list>"},
+
+	{{"shared-umem", no_argument,		NULL,  9  },
+	 "Use one UMEM for all queues (xsk_socket__create_shared)"},
+
+	{{"frames",	 required_argument,	NULL,  10 },
+	 "Number of UMEM frames per socket, default=4096", "<n>"},
+
+	{{"frame-size",	 required_argument,	NULL,  11 },
+	 "UMEM frame size, 2048 or 4096 (default)", "<size>"},
+
+	{{"hugepages",	 no_argument,		NULL,  12 },
+	 "Back the UMEM with huge pages (MAP_HUGETLB)"},
+
+	{{"rx-ring",	 required_argument,	NULL,  13 },
+	 "RX ring size, power of 2, default=2048", "<n>"},
+
+	{{"tx-ring",	 required_argument,	NULL,  14 },
+	 "TX ring size, power of 2, default=2048", "<n>"},
+
+	{{"fill-ring",	 required_argument,	NULL,  15 },
+	 "Fill ring size, power of 2, default=2048", "<n>"},
+
+	{{"comp-ring",	 required_argument,	NULL,  16 },
+	 "Completion ring size, power of 2, default=2048", "<n>"},
+
+	{{"rx-batch",	 required_argument,	NULL,  17 },
+	 "Max packets per RX batch, also the fill ring refill watermark, default=64",
+	 "<n>"},
+
+	{{"tx-batch",	 required_argument,	NULL,  18 },
+	 "Max descriptors per TX submit, default=64",
+	 "<n>"},
+
+	{{"tx-only",	 no_argument,		NULL,  25 },
+	 "Traffic generator: only send templated UDP packets"},
+
+	{{"tx-rate",	 required_argument,	NULL,  26 },
+	 "Traffic generator rate over all queues, default=0 (line rate)",
+	 "<pps>"},
+
+	{{"tx-size",	 required_argument,	NULL,  27 },
+	 "Traffic generator frame size without FCS, default=60", "<bytes>"},
+
+	{{"tx-flows",	 required_argument,	NULL,  28 },
+	 "Traffic generator UDP flows to cycle through, default=1", "<n>"},
+
+	{{"af-packet",	 no_argument,		NULL,  30 },
+	 "Use AF_PACKET with a TPACKET_V3 ring instead of AF_XDP, for comparison"},
+
+	{{"tx-csum-offload", no_argument,	NULL,  32 },
+	 "Let the NIC fill in checksums handlers ask for, via AF_XDP TX metadata"},
+
+	{{"multi-buffer", no_argument,		NULL,  23 },
+	 "Receive and send packets larger than a frame (XDP_USE_SG)"},
+
 	{{"poll-mode",	 no_argument,		NULL, 'p' },
 	 "Use the poll() API waiting for packets to arrive"},
 
+	{{"need-wakeup", no_argument,		NULL,  7  },
+	 "Only wake up the kernel for RX/TX when it asks for it"},
+
+	{{"busy-poll",	 no_argument,		NULL,  8  },
+	 "Busy-poll the NIC queue from the application's syscalls"},
+
 	{{"quiet",	 no_argument,		NULL, 'q' },
 	 "Quiet mode (no output)"},
 
+	{{"handler",	 required_argument,	NULL,  19 },
+	 "Packet handler: built-in <name> or shared object <file.so>",
+	 "<name|file>"},
+
+	{{"handler-args", required_argument,	NULL,  20 },
+	 "Argument string passed to the handler's init()", "<args>"},
+
+	{{"pass-dev",	 required_argument,	NULL,  21 },
+	 "Create TAP device <ifname> to pass packets to the kernel through",
+	 "<ifname>"},
+
 	{{"filename",    required_argument,	NULL,  1  },
 	 "Load program from <file>", "<file>"},
 
 	{{"progname",	 required_argument,	NULL,  2  },
 	 "Load program from function <name> in the ELF file", "<name>"},
 
+	{{"rules",	 required_argument,	NULL,  22 },
+	 "Load steering rules from <file> into the --filename program",
+	 "<file>"},
+
+	{{"rx-metadata", no_argument,		NULL,  24 },
+	 "Pass RX timestamp, hash and rule id from the --filename program to the handler"},
+
+	{{"flow-hash",	 no_argument,		NULL,  31 },
+	 "Spread redirected flows over all sockets by inner 5-tuple hash (implies --shared-umem)"},
+
+	{{"ctrl-sock",	 required_argument,	NULL,  29 },
+	 "Accept reconfiguration commands on Unix socket <path>", "<path>"},
+
 	{{0, 0, NULL,  0 }, NULL, false}
 };
 
-static bool global_exit;
+/* Only written by the signal handler */
+static volatile sig_atomic_t global_exit;
+
+static bool is_pow2(__u32 n)
+{
+	return n && !(n & (n - 1));
+}
+
+uint64_t gettime(void)
+{
+	struct timespec t;
+	int res;
+
+	res = clock_gettime(CLOCK_MONOTONIC, &t);
+	if (res < 0) {
+		fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
+		exit(EXIT_FAIL);
+	}
+	return (uint64_t) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
+}
+
+static unsigned int lat_hist_index(uint64_t ns)
+{
+	unsigned int shift;
+
+	if (ns < LAT_HIST_SUB)
+		return ns;
+	if (ns >= 1ULL << LAT_HIST_MAX_BITS)
+		return LAT_HIST_BUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(ns) - LAT_HIST_SUB_BITS;
+	return (shift + 1) * LAT_HIST_SUB + (ns >> shift) - LAT_HIST_SUB;
+}
+
+/* Highest value that falls into bucket idx */
+static uint64_t lat_hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < LAT_HIST_SUB)
+		return idx;
+
+	shift = idx / LAT_HIST_SUB - 1;
+	return ((uint64_t)(LAT_HIST_SUB + idx % LAT_HIST_SUB + 1) << shift) - 1;
+}
+
+static bool fwd_mode(void)
+{
+	return cfg.redirect_ifindex > 0;
+}
+
+static int parse_mac(const char *str, uint8_t mac[ETH_ALEN])
+{
+	if (sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+		   &mac[2], &mac[3], &mac[4], &mac[5]) != ETH_ALEN)
+		return -EINVAL;
+	return 0;
+}
+
+static int get_ifname_mac(const char *ifname, uint8_t mac[ETH_ALEN])
+{
+	struct ifreq ifr;
+	int sock, ret = 0;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0)
+		ret = -errno;
+	else
+		memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	close(sock);
+	return ret;
+}
+
+/* NUMA node of the NIC, or -1 if unknown (e.g. virtual devices) */
+static int get_ifname_numa_node(const char *ifname)
+{
+	char path[128];
+	int node = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+		 ifname);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+static uint64_t get_hugepage_size(void)
+{
+	uint64_t size = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return HUGEPAGE_SIZE;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Hugepagesize: %lu kB", &size) == 1)
+			break;
+	fclose(f);
+	return size ? size * 1024 : HUGEPAGE_SIZE;
+}
+
+/* Allocate the UMEM area with mmap(), from huge pages if asked for (falling
+ * back to normal pages if none are available) and preferably on the NUMA
+ * node of the NIC. The actual outcome is reported, as both are best-effort.
+ * On return *size is the mapped size, rounded up to the page size used.
+ */
+static void *alloc_umem_area(uint64_t *size, const char *ifname,
+			     bool hugepages)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	uint64_t page_size = getpagesize();
+	unsigned long nodemask;
+	int nic_node, node = -1;
+	void *area = MAP_FAILED;
+	uint64_t len;
+
+	if (hugepages) {
+		page_size = get_hugepage_size();
+		len = (*size + page_size - 1) & ~(page_size - 1);
+		area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    flags | MAP_HUGETLB, -1, 0);
+		if (area == MAP_FAILED) {
+			fprintf(stderr, "WARN: No huge pages for the UMEM \"%s\", "
+				"using normal pages\n", strerror(errno));
+			page_size = getpagesize();
+		}
+	}
+
+	if (area == MAP_FAILED) {
+		len = (*size + page_size - 1) & ~(page_size - 1);
+		area = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (area == MAP_FAILED)
+			return NULL;
+	}
+
+	/* Prefer, but don't insist on, the NIC's node. Must be done before
+	 * the pages are faulted in, which we then do right away. */
+	nic_node = get_ifname_numa_node(ifname);
+	if (nic_node >= 0 && nic_node < (int)(8 * sizeof(nodemask))) {
+		nodemask = 1UL << nic_node;
+		if (syscall(SYS_mbind, area, len, MPOL_PREFERRED, &nodemask,
+			    8 * sizeof(nodemask), 0))
+			fprintf(stderr, "WARN: mbind to NUMA node %d failed \"%s\"\n",
+				nic_node, strerror(errno));
+	}
+	memset(area, 0, len);
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, area,
+		    MPOL_F_NODE | MPOL_F_ADDR))
+		node = -1;
+
+	if (verbose)
+		printf("UMEM: %lu MiB in %lu kB pages, NUMA node %d (NIC node %d)\n",
+		       len >> 20, page_size >> 10, node, nic_node);
+
+	*size = len;
+	return area;
+}
+
+/* Whether the running kernel is version major.minor or later */
+static bool kernel_at_least(int major, int minor)
+{
+	struct utsname uts;
+	int maj, min;
+
+	if (uname(&uts) || sscanf(uts.release, "%d.%d", &maj, &min) != 2)
+		return false;
+	return maj > major || (maj == major && min >= minor);
+}
+
+/* Register the UMEM area of umem with the kernel */
+static int xsk_umem_register(struct xsk_umem_info *umem)
+{
+	struct xsk_umem_config umem_cfg = {
+		.fill_size = umem->fill_size,
+		.comp_size = umem->comp_size,
+		.frame_size = umem->frame_size,
+		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+		.flags = XSK_UMEM__DEFAULT_FLAGS,
+	};
+	int ret;
+
+	if (tx_csum_offload) {
+		umem_cfg.flags |= XDP_UMEM_TX_METADATA_LEN;
+		umem_cfg.tx_metadata_len = sizeof(struct xsk_tx_metadata);
+	}
+
+	ret = xsk_umem__create(&umem->umem, umem->buffer, umem->size,
+			       &umem->fq, &umem->cq, &umem_cfg);
+	if (ret == -EINVAL && tx_csum_offload && kernel_at_least(6, 8)) {
+		/* Kernel v6.8 to v6.10: the length without the flag. Older
+		 * kernels would accept that too, but ignore the length. */
+		umem_cfg.flags &= ~XDP_UMEM_TX_METADATA_LEN;
+		ret = xsk_umem__create(&umem->umem, umem->buffer, umem->size,
+				       &umem->fq, &umem->cq, &umem_cfg);
+	}
+	if (ret == -EINVAL && tx_csum_offload) {
+		/* No TX metadata: checksums are then done in software */
+		fprintf(stderr, "WARN: No AF_XDP TX metadata support, "
+			"computing checksums in software\n");
+		tx_csum_offload = false;
+		umem_cfg.flags &= ~XDP_UMEM_TX_METADATA_LEN;
+		umem_cfg.tx_metadata_len = 0;
+		ret = xsk_umem__create(&umem->umem, umem->buffer, umem->size,
+				       &umem->fq, &umem->cq, &umem_cfg);
+	}
+	return ret;
+}
 
-static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size)
+static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size,
+						uint32_t frame_size)
 {
 	struct xsk_umem_info *umem;
+	uint32_t i;
 	int ret;
 
 	umem = calloc(1, sizeof(*umem));
 	if (!umem)
 		return NULL;
 
-	ret = xsk_umem__create(&umem->umem, buffer, size, &umem->fq, &umem->cq,
-			       NULL);
+	umem->buffer = buffer;
+	umem->size = size;
+	umem->frame_size = frame_size;
+	umem->fill_size = cfg.xsk_fill_size;
+	umem->comp_size = cfg.xsk_comp_size;
+
+	ret = xsk_umem_register(umem);
 	if (ret) {
+		free(umem);
 		errno = -ret;
 		return NULL;
 	}
 
-	umem->buffer = buffer;
+	/* Initialize umem frame allocation */
+	umem->pool.nr_frames = size / frame_size;
+	umem->pool.addrs = calloc(umem->pool.nr_frames, sizeof(uint64_t));
+	if (!umem->pool.addrs) {
+		xsk_umem__delete(umem->umem);
+		free(umem);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < umem->pool.nr_frames; i++)
+		umem->pool.addrs[i] = (uint64_t)i * frame_size;
+
+	umem->pool.nr_free = umem->pool.nr_frames;
+	pthread_mutex_init(&umem->pool.lock, NULL);
+
 	return umem;
 }
 
-static uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk)
+/* Move up to half a cache worth of frames from the global pool */
+static uint32_t xsk_frame_cache_refill(struct xsk_socket_info *xsk)
+{
+	struct xsk_frame_cache *cache = &xsk->frame_cache;
+	struct xsk_frame_pool *pool = &xsk->umem->pool;
+	uint32_t nr = FRAME_CACHE_SIZE / 2;
+
+	pthread_mutex_lock(&pool->lock);
+	if (nr > pool->nr_free)
+		nr = pool->nr_free;
+	pool->nr_free -= nr;
+	memcpy(&cache->addrs[cache->nr], &pool->addrs[pool->nr_free],
+	       nr * sizeof(uint64_t));
+	pthread_mutex_unlock(&pool->lock);
+
+	cache->nr += nr;
+	return nr;
+}
+
+/* Give half of the cache back to the global pool */
+static void xsk_frame_cache_flush(struct xsk_socket_info *xsk, uint32_t nr)
+{
+	struct xsk_frame_cache *cache = &xsk->frame_cache;
+	struct xsk_frame_pool *pool = &xsk->umem->pool;
+
+	cache->nr -= nr;
+
+	pthread_mutex_lock(&pool->lock);
+	assert(pool->nr_free + nr <= pool->nr_frames);
+	memcpy(&pool->addrs[pool->nr_free], &cache->addrs[cache->nr],
+	       nr * sizeof(uint64_t));
+	pool->nr_free += nr;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Allocate up to nb frames, returns the number of frames obtained */
+static uint32_t xsk_alloc_umem_frames(struct xsk_socket_info *xsk,
+				      uint64_t *frames, uint32_t nb)
 {
-	uint64_t frame;
-	if (xsk->umem_frame_free == 0)
-		return INVALID_UMEM_FRAME;
+	struct xsk_frame_cache *cache = &xsk->frame_cache;
+	uint32_t i;
 
-	frame = xsk->umem_frame_addr[--xsk->umem_frame_free];
-	xsk->umem_frame_addr[xsk->umem_frame_free] = INVALID_UMEM_FRAME;
-	return frame;
+	for (i = 0; i < nb; i++) {
+		if (!cache->nr && !xsk_frame_cache_refill(xsk))
+			break;
+		frames[i] = cache->addrs[--cache->nr];
+	}
+	return i;
 }
 
 static void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame)
 {
-	assert(xsk->umem_frame_free < NUM_FRAMES);
+	struct xsk_frame_cache *cache = &xsk->frame_cache;
+
+	if (cache->nr == FRAME_CACHE_SIZE)
+		xsk_frame_cache_flush(xsk, FRAME_CACHE_SIZE / 2);
+
+	cache->addrs[cache->nr++] = frame;
+}
+
+/* Hand up to nb free frames to the kernel through the fill ring, returns
+ * the number of frames actually stocked.
+ */
+static uint32_t xsk_stock_fill_ring(struct xsk_socket_info *xsk, uint32_t nb)
+{
+	uint64_t frames[MAX_BATCH_SIZE];
+	uint32_t i, n, nb_free, idx_fq = 0, done = 0;
+
+	while (done < nb) {
+		n = nb - done;
+		if (n > MAX_BATCH_SIZE)
+			n = MAX_BATCH_SIZE;
+
+		/* Reserve is all-or-nothing, check the ring has room first */
+		nb_free = xsk_prod_nb_free(&xsk->fq, n);
+		if (n > nb_free)
+			n = nb_free;
+
+		n = xsk_alloc_umem_frames(xsk, frames, n);
+		if (!n)
+			break;
+
+		xsk_ring_prod__reserve(&xsk->fq, n, &idx_fq);
+		for (i = 0; i < n; i++)
+			*xsk_ring_prod__fill_addr(&xsk->fq, idx_fq++) = frames[i];
+		xsk_ring_prod__submit(&xsk->fq, n);
+
+		done += n;
+	}
+	return done;
+}
+
+/* Watermark based refill: leave the fill ring alone until at least a full
+ * RX batch worth of slots is free, then top it up as far as free frames
+ * allow. Runs once per loop iteration and never waits for the kernel.
+ */
+static void xsk_refill_fill_ring(struct xsk_socket_info *xsk)
+{
+	uint32_t watermark = cfg.xsk_rx_batch;
+	uint32_t nb_free;
+
+	/* Only re-reads the kernel's consumer pointer below the watermark */
+	nb_free = xsk_prod_nb_free(&xsk->fq, watermark);
+	if (nb_free < watermark)
+		return;
+
+	/* Refilling anyway, so get the exact count to see if the kernel
+	 * ran dry, which means it had to drop packets */
+	nb_free = xsk_prod_nb_free(&xsk->fq, xsk->fq.size);
+	if (nb_free == xsk->fq.size)
+		stat_add(&xsk->stats.fill_empty, 1);
+
+	xsk_stock_fill_ring(xsk, nb_free);
+}
+
+/* Let our own recvfrom()/sendto()/poll() calls run the driver's NAPI
+ * processing, instead of relying on interrupts and softirq.
+ */
+static int set_busy_poll(int fd)
+{
+	int sock_opt;
+
+	sock_opt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+		       (void *)&sock_opt, sizeof(sock_opt)) < 0)
+		return -errno;
+
+	sock_opt = BUSY_POLL_USECS;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+		       (void *)&sock_opt, sizeof(sock_opt)) < 0)
+		return -errno;
 
-	xsk->umem_frame_addr[xsk->umem_frame_free++] = frame;
+	sock_opt = cfg.xsk_rx_batch;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+		       (void *)&sock_opt, sizeof(sock_opt)) < 0)
+		return -errno;
+
+	return 0;
 }
 
-static uint64_t xsk_umem_free_frames(struct xsk_socket_info *xsk)
+/* Which mode the kernel actually bound the socket in */
+static int xsk_get_zero_copy(struct xsk_socket_info *xsk, bool *zero_copy)
 {
-	return xsk->umem_frame_free;
+	struct xdp_options opts;
+	socklen_t optlen = sizeof(opts);
+
+	if (getsockopt(xsk_socket__fd(xsk->xsk), SOL_XDP, XDP_OPTIONS,
+		       &opts, &optlen) < 0)
+		return -errno;
+
+	*zero_copy = opts.flags & XDP_OPTIONS_ZEROCOPY;
+	return 0;
 }
 
 static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
-						    struct xsk_umem_info *umem)
+						    struct xsk_umem_info *umem,
+						    const char *ifname,
+						    int ifindex, int queue_id,
+						    int map_fd)
 {
 	struct xsk_socket_config xsk_cfg;
 	struct xsk_socket_info *xsk_info;
-	uint32_t idx;
-	int i;
+	uint32_t stock_frames;
+	bool zc_auto;
 	int ret;
 	uint32_t prog_id;
 
-	xsk_info = calloc(1, sizeof(*xsk_info));
+	/* Aligned, so the stats don't share cache lines with anything else */
+	xsk_info = aligned_alloc(CACHE_LINE_SIZE, sizeof(*xsk_info));
 	if (!xsk_info)
 		return NULL;
+	memset(xsk_info, 0, sizeof(*xsk_info));
 
 	xsk_info->umem = umem;
-	xsk_cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
-	xsk_cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+	xsk_info->ifname = ifname;
+	xsk_info->ifindex = ifindex;
+	xsk_info->queue_id = queue_id;
+	xsk_info->cpu = -1;
+	pthread_spin_init(&xsk_info->tx_lock, PTHREAD_PROCESS_PRIVATE);
+	xsk_cfg.rx_size = cfg->xsk_rx_size;
+	xsk_cfg.tx_size = cfg->xsk_tx_size;
 	xsk_cfg.xdp_flags = cfg->xdp_flags;
 	xsk_cfg.bind_flags = cfg->xsk_bind_flags;
-	xsk_cfg.libbpf_flags = (custom_xsk) ? XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD: 0;
-	ret = xsk_socket__create(&xsk_info->xsk, cfg->ifname,
-				 cfg->xsk_if_queue, umem->umem, &xsk_info->rx,
-				 &xsk_info->tx, &xsk_cfg);
+	/* A TX-only socket has no use for an XDP program, not even libxdp's
+	 * default one */
+	xsk_cfg.libbpf_flags = (custom_xsk || cfg->xsk_tx_only) ?
+		XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD : 0;
+	/* Unless forced either way, try zero-copy first. Only the first
+	 * socket on a UMEM binds with its own flags, the others inherit the
+	 * mode of the UMEM. */
+	zc_auto = !(cfg->xsk_bind_flags & (XDP_COPY | XDP_ZEROCOPY)) &&
+		  !umem->nr_users;
+	if (zc_auto)
+		xsk_cfg.bind_flags |= XDP_ZEROCOPY;
+
+	/* Each socket has its own fill and completion ring, also when the
+	 * UMEM is shared with sockets on other queues or devices */
+	ret = xsk_socket__create_shared(&xsk_info->xsk, ifname,
+					queue_id, umem->umem,
+					cfg->xsk_tx_only ? NULL : &xsk_info->rx,
+					&xsk_info->tx, &xsk_info->fq,
+					&xsk_info->cq, &xsk_cfg);
+	if (ret && zc_auto) {
+		if (verbose)
+			fprintf(stderr, "WARN: No zero-copy on %s queue %d \"%s\", "
+				"falling back to copy mode\n", ifname, queue_id,
+				strerror(-ret));
+		xsk_cfg.bind_flags &= ~XDP_ZEROCOPY;
+		xsk_cfg.bind_flags |= XDP_COPY;
+
+		/* libxdp unmapped the fill and completion rings of the UMEM
+		 * when the bind failed, and the kernel won't set up a second
+		 * pair on its socket: start over with a new registration. We
+		 * are its first user, nothing else refers to it yet. */
+		xsk_umem__delete(umem->umem);
+		umem->umem = NULL;
+		ret = xsk_umem_register(umem);
+		if (ret)
+			goto error_exit;
+
+		ret = xsk_socket__create_shared(&xsk_info->xsk, ifname,
+						queue_id, umem->umem,
+						cfg->xsk_tx_only ?
+						NULL : &xsk_info->rx,
+						&xsk_info->tx, &xsk_info->fq,
+						&xsk_info->cq, &xsk_cfg);
+	}
 	if (ret)
 		goto error_exit;
+	umem->nr_users++;
 
-	if (custom_xsk) {
-		ret = xsk_socket__update_xskmap(xsk_info->xsk, xsk_map_fd);
+	ret = xsk_get_zero_copy(xsk_info, &xsk_info->zero_copy);
+	if (ret)
+		goto error_exit;
+	if (verbose)
+		printf("%s queue %d: %s mode\n", ifname, queue_id,
+		       xsk_info->zero_copy ? "zero-copy" : "copy");
+
+	/* A TX-only socket has no RX ring, and no XDP program */
+	if (cfg->xsk_tx_only) {
+		/* Nothing to do */
+	} else if (custom_xsk) {
+		ret = xsk_socket__update_xskmap(xsk_info->xsk, map_fd);
 		if (ret)
 			goto error_exit;
 	} else {
 		/* Getting the program ID must be after the xdp_socket__create() call */
-		if (bpf_xdp_query_id(cfg->ifindex, cfg->xdp_flags, &prog_id))
+		if (bpf_xdp_query_id(ifindex, cfg->xdp_flags, &prog_id))
 			goto error_exit;
 	}
 
-	/* Initialize umem frame allocation */
-	for (i = 0; i < NUM_FRAMES; i++)
-		xsk_info->umem_frame_addr[i] = i * FRAME_SIZE;
-
-	xsk_info->umem_frame_free = NUM_FRAMES;
+	if (cfg->xsk_busy_poll) {
+		ret = set_busy_poll(xsk_socket__fd(xsk_info->xsk));
+		if (ret)
+			goto error_exit;
+	}
 
 	/* Stuff the receive path with buffers, we assume we have enough */
-	ret = xsk_ring_prod__reserve(&xsk_info->umem->fq,
-				     XSK_RING_PROD__DEFAULT_NUM_DESCS,
-				     &idx);
-
-	if (ret != XSK_RING_PROD__DEFAULT_NUM_DESCS)
+	stock_frames = cfg->xsk_tx_only ? 0 :
+		xsk_stock_fill_ring(xsk_info, umem->fill_size);
+	if (!cfg->xsk_tx_only && stock_frames != umem->fill_size) {
+		ret = -ENOMEM;
 		goto error_exit;
-
-	for (i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i ++)
-		*xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx++) =
-			xsk_alloc_umem_frame(xsk_info);
-
-	xsk_ring_prod__submit(&xsk_info->umem->fq,
-			      XSK_RING_PROD__DEFAULT_NUM_DESCS);
+	}
 
 	return xsk_info;
 
 error_exit:
+	if (xsk_info->xsk) {
+		xsk_socket__delete(xsk_info->xsk);
+		umem->nr_users--;
+	}
+	free(xsk_info);
 	errno = -ret;
 	return NULL;
 }
 
 static void complete_tx(struct xsk_socket_info *xsk)
 {
-	unsigned int completed;
-	uint32_t idx_cq;
+	unsigned int completed, nfill, i;
+	uint32_t idx_cq, idx_fq = 0;
 
-	if (!xsk->outstanding_tx)
+	if (!__atomic_load_n(&xsk->outstanding_tx, __ATOMIC_RELAXED))
 		return;
 
-	sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+	/* With XDP_USE_NEED_WAKEUP the kernel flags the TX ring when it needs
+	 * a kick, saving a syscall per batch. Without it we must always kick,
+	 * and when busy-polling the kick is what drives the driver.
+	 */
+	if (cfg.xsk_busy_poll || !(cfg.xsk_bind_flags & XDP_USE_NEED_WAKEUP) ||
+	    xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+		sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+		stat_add(&xsk->stats.wakeups, 1);
+	}
 
-	/* Collect/free completed TX buffers */
-	completed = xsk_ring_cons__peek(&xsk->umem->cq,
-					XSK_RING_CONS__DEFAULT_NUM_DESCS,
-					&idx_cq);
+	/* Collect/free completed TX buffers, all of them: one RX batch can
+	 * be submitted as several --tx-batch chunks, and completions must not
+	 * fall behind or the frames pile up in the TX and completion rings */
+	completed = xsk_ring_cons__peek(&xsk->cq, xsk->umem->comp_size, &idx_cq);
 
 	if (completed > 0) {
-		for (int i = 0; i < completed; i++)
+		/* Recycle the frames straight into our fill ring as far as it
+		 * has room, skipping the free pool. Only the rest, e.g. when
+		 * forwarding in one direction, goes back to the pool. */
+		nfill = cfg.xsk_tx_only ? 0 : /* No RX, fill ring stays empty */
+			xsk_prod_nb_free(&xsk->fq, completed);
+		if (nfill > completed)
+			nfill = completed;
+		if (nfill) {
+			xsk_ring_prod__reserve(&xsk->fq, nfill, &idx_fq);
+			for (i = 0; i < nfill; i++)
+				*xsk_ring_prod__fill_addr(&xsk->fq, idx_fq++) =
+					*xsk_ring_cons__comp_addr(&xsk->cq,
+								  idx_cq++);
+			xsk_ring_prod__submit(&xsk->fq, nfill);
+		}
+
+		for (i = nfill; i < completed; i++)
 			xsk_free_umem_frame(xsk,
-					    *xsk_ring_cons__comp_addr(&xsk->umem->cq,
+					    *xsk_ring_cons__comp_addr(&xsk->cq,
 								      idx_cq++));
 
-		xsk_ring_cons__release(&xsk->umem->cq, completed);
+		xsk_ring_cons__release(&xsk->cq, completed);
+
+		pthread_spin_lock(&xsk->tx_lock);
 		xsk->outstanding_tx -= completed < xsk->outstanding_tx ?
 			completed : xsk->outstanding_tx;
+		pthread_spin_unlock(&xsk->tx_lock);
 	}
 }
 
-static inline __sum16 csum16_add(__sum16 csum, __be16 addend)
-{
-	uint16_t res = (uint16_t)csum;
-
-	res += (__u16)addend;
-	return (__sum16)(res + (res < (__u16)addend));
-}
-
-static inline __sum16 csum16_sub(__sum16 csum, __be16 addend)
-{
-	return csum16_add(csum, ~addend);
-}
-
-static inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
+/* Returns true if the (rewritten) frame should be sent back out, in which
+ * case the caller queues it for transmission with the rest of the batch.
+ */
+static bool process_packet(uint8_t *pkt, uint32_t len)
 {
-	*sum = ~csum16_add(csum16_sub(~(*sum), old), new);
-}
-
-static bool process_packet(struct xsk_socket_info *xsk,
-			   uint64_t addr, uint32_t len)
-{
-	uint8_t *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
-
 	/* Lesson#3: Write an IPv6 ICMP ECHO parser to send responses
 	 *
 	 * Some assumptions to make it easier:
@@ -291,8 +955,6 @@ static bool process_packet(struct xsk_socket_info *xsk,
 	 * - Recalculate the icmp checksum */
 
 	if (false) {
-		int ret;
-		uint32_t tx_idx = 0;
 		uint8_t tmp_mac[ETH_ALEN];
 		struct in6_addr tmp_ip;
 		struct ethhdr *eth = (struct ethhdr *) pkt;
@@ -319,214 +981,2136 @@ static bool process_packet(struct xsk_socket_info *xsk,
 			      htons(ICMPV6_ECHO_REQUEST << 8),
 			      htons(ICMPV6_ECHO_REPLY << 8));
 
-		/* Here we sent the packet out of the receive port. Note that
-		 * we allocate one entry and schedule it. Your design would be
-		 * faster if you do batch processing/transmission */
-
-		ret = xsk_ring_prod__reserve(&xsk->tx, 1, &tx_idx);
-		if (ret != 1) {
-			/* No more transmit slots, drop the packet */
-			return false;
-		}
-
-		xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->addr = addr;
-		xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->len = len;
-		xsk_ring_prod__submit(&xsk->tx, 1);
-		xsk->outstanding_tx++;
-
-		xsk->stats.tx_bytes += len;
-		xsk->stats.tx_packets++;
+		/* Here we send the packet out of the receive port. The TX
+		 * descriptor is written by handle_receive_packets(), which
+		 * reserves and submits TX slots for the whole RX batch. */
 		return true;
 	}
 
 	return false;
 }
 
-static void handle_receive_packets(struct xsk_socket_info *xsk)
+/* The default handler runs process_packet() from the lesson */
+static void default_handler_process(struct xsk_handler_ctx *ctx,
+				    struct xsk_pkt *pkts, unsigned int n)
 {
-	unsigned int rcvd, stock_frames, i;
-	uint32_t idx_rx = 0, idx_fq = 0;
-	int ret;
+	unsigned int i;
 
-	rcvd = xsk_ring_cons__peek(&xsk->rx, RX_BATCH_SIZE, &idx_rx);
-	if (!rcvd)
-		return;
+	for (i = 0; i < n; i++)
+		if (process_packet(pkts[i].data, pkts[i].len))
+			pkts[i].verdict = XSK_VERDICT_TX;
+}
 
-	/* Stuff the ring with as much frames as possible */
-	stock_frames = xsk_prod_nb_free(&xsk->umem->fq,
-					xsk_umem_free_frames(xsk));
+static const struct xsk_handler default_handler = {
+	.name    = "default",
+	.process = default_handler_process,
+};
 
-	if (stock_frames > 0) {
+/* Forwarding mode: every frame goes out of the peer socket on the other
+ * device, with the MAC addresses rewritten like xdp_redirect_map_func does
+ * in packet-solutions/xdp_prog_kern_03.c. Both sockets are on the same UMEM,
+ * so the frame itself is not copied.
+ */
+static void l2fwd_handler_process(struct xsk_handler_ctx *ctx,
+				  struct xsk_pkt *pkts, unsigned int n)
+{
+	struct xsk_socket_info *out;
+	struct ethhdr *eth;
+	unsigned int i;
 
-		ret = xsk_ring_prod__reserve(&xsk->umem->fq, stock_frames,
-					     &idx_fq);
+	if (ctx->peer_xsk < 0)
+		return;
+	out = xsks[ctx->peer_xsk];
 
-		/* This should not happen, but just in case */
-		while (ret != stock_frames)
-			ret = xsk_ring_prod__reserve(&xsk->umem->fq, rcvd,
-						     &idx_fq);
+	for (i = 0; i < n; i++) {
+		if (pkts[i].len < sizeof(*eth))
+			continue;
 
-		for (i = 0; i < stock_frames; i++)
-			*xsk_ring_prod__fill_addr(&xsk->umem->fq, idx_fq++) =
-				xsk_alloc_umem_frame(xsk);
+		eth = (struct ethhdr *)pkts[i].data;
+		if (out->has_next_hop)
+			memcpy(eth->h_dest, out->next_hop_mac, ETH_ALEN);
+		memcpy(eth->h_source, out->if_mac, ETH_ALEN);
 
-		xsk_ring_prod__submit(&xsk->umem->fq, stock_frames);
+		pkts[i].fwd_xsk = ctx->peer_xsk;
+		pkts[i].verdict = XSK_VERDICT_FWD;
 	}
+}
 
-	/* Process received packets */
-	for (i = 0; i < rcvd; i++) {
-		uint64_t addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
-		uint32_t len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
+static const struct xsk_handler l2fwd_handler = {
+	.name    = "l2fwd",
+	.process = l2fwd_handler_process,
+};
 
-		if (!process_packet(xsk, addr, len))
-			xsk_free_umem_frame(xsk, addr);
+/* Copies every packet into a contiguous buffer and drops it. Compared with
+ * the default handler, this shows what it costs to linearize multi-buffer
+ * packets instead of working on the scatter list.
+ */
+static void linearize_handler_process(struct xsk_handler_ctx *ctx,
+				      struct xsk_pkt *pkts, unsigned int n)
+{
+	static __thread uint8_t buf[MAX_FRAGS * XSK_UMEM__DEFAULT_FRAME_SIZE];
+	static __thread volatile uint32_t sink;
+	unsigned int i;
 
-		xsk->stats.rx_bytes += len;
-	}
+	for (i = 0; i < n; i++)
+		sink += xsk_pkt_linearize(&pkts[i], buf, sizeof(buf));
+}
 
-	xsk_ring_cons__release(&xsk->rx, rcvd);
-	xsk->stats.rx_packets += rcvd;
+static const struct xsk_handler linearize_handler = {
+	.name    = "linearize",
+	.process = linearize_handler_process,
+};
 
-	/* Do we need to wake up the kernel for transmission */
-	complete_tx(xsk);
-  }
+/* Runs xsk_classify() on every batch and drops it, to measure the parser.
+ * --handler-args scalar, sse4.2 or avx2 forces an implementation.
+ */
+static int classify_handler_init(const char *args, void **priv)
+{
+	static enum xsk_classify_impl impl;
+	enum xsk_classify_impl best = xsk_classify_best();
+
+	impl = best;
+	if (args) {
+		if (!strcmp(args, "scalar"))
+			impl = XSK_CLASSIFY_SCALAR;
+		else if (!strcmp(args, "sse4.2"))
+			impl = XSK_CLASSIFY_SSE42;
+		else if (!strcmp(args, "avx2"))
+			impl = XSK_CLASSIFY_AVX2;
+		else
+			return -EINVAL;
+		if (impl > best) {
+			fprintf(stderr, "ERROR: CPU doesn't support %s\n", args);
+			return -EOPNOTSUPP;
+		}
+	}
+	printf("Classifier: %s\n", xsk_classify_name(impl));
 
-static void rx_and_process(struct config *cfg,
-			   struct xsk_socket_info *xsk_socket)
+	*priv = &impl;
+	return 0;
+}
+
+static void classify_handler_process(struct xsk_handler_ctx *ctx,
+				     struct xsk_pkt *pkts, unsigned int n)
 {
-	struct pollfd fds[2];
-	int ret, nfds = 1;
+	static __thread struct xsk_pkt_class cls[MAX_BATCH_SIZE];
+	static __thread volatile uint32_t sink;
+	enum xsk_classify_impl impl = *(enum xsk_classify_impl *)ctx->priv;
+	unsigned int i;
+
+	xsk_classify_with(impl, pkts, n, cls);
+	for (i = 0; i < n; i++)
+		sink += cls[i].hash;
+}
 
-	memset(fds, 0, sizeof(fds));
-	fds[0].fd = xsk_socket__fd(xsk_socket->xsk);
-	fds[0].events = POLLIN;
+static const struct xsk_handler classify_handler = {
+	.name    = "classify",
+	.init    = classify_handler_init,
+	.process = classify_handler_process,
+};
 
-	while(!global_exit) {
-		if (cfg->xsk_poll_mode) {
-			ret = poll(fds, nfds, -1);
-			if (ret <= 0 || ret > 1)
-				continue;
-		}
-		handle_receive_packets(xsk_socket);
+/* Verifies the TCP/UDP checksum of every packet and drops it, to compare
+ * the csum_partial() implementations: --handler-args scalar, avx2 or neon.
+ */
+static int csum_handler_init(const char *args, void **priv)
+{
+	static csum_partial_fn fn;
+
+	fn = csum_partial_impl(args);
+	if (!fn) {
+		fprintf(stderr, "ERROR: Can't use checksum implementation %s\n",
+			args);
+		return -EOPNOTSUPP;
 	}
+	printf("Checksum: %s\n", args ? args : csum_partial_name());
+
+	*priv = &fn;
+	return 0;
 }
 
-#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
-static uint64_t gettime(void)
+static void csum_handler_process(struct xsk_handler_ctx *ctx,
+				 struct xsk_pkt *pkts, unsigned int n)
 {
-	struct timespec t;
-	int res;
+	static __thread struct xsk_pkt_class cls[MAX_BATCH_SIZE];
+	static __thread volatile uint32_t sink;
+	csum_partial_fn fn = *(csum_partial_fn *)ctx->priv;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	uint32_t sum, len;
+	unsigned int i;
+
+	xsk_classify(pkts, n, cls);
+	for (i = 0; i < n; i++) {
+		if ((cls[i].l4_proto != IPPROTO_TCP &&
+		     cls[i].l4_proto != IPPROTO_UDP) ||
+		    !cls[i].l4_off || pkts[i].nr_frags)
+			continue;
+
+		if (cls[i].l3_proto == ETH_P_IP) {
+			iph = (struct iphdr *)(pkts[i].data + cls[i].l3_off);
+			len = ntohs(iph->tot_len) - (cls[i].l4_off - cls[i].l3_off);
+			sum = csum_tcpudp_ipv4(iph->saddr, iph->daddr, len,
+					       cls[i].l4_proto, 0);
+		} else {
+			ip6h = (struct ipv6hdr *)(pkts[i].data + cls[i].l3_off);
+			len = ntohs(ip6h->payload_len);
+			sum = csum_tcpudp_ipv6(&ip6h->saddr, &ip6h->daddr, len,
+					       cls[i].l4_proto, 0);
+		}
+		if (cls[i].l4_off + len > pkts[i].len)
+			continue;
 
-	res = clock_gettime(CLOCK_MONOTONIC, &t);
-	if (res < 0) {
-		fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
-		exit(EXIT_FAIL);
+		/* Folds to 0 for a correct checksum */
+		sink += csum_fold(fn(pkts[i].data + cls[i].l4_off, len, sum));
 	}
-	return (uint64_t) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
 }
 
-static double calc_period(struct stats_record *r, struct stats_record *p)
+static const struct xsk_handler csum_handler = {
+	.name    = "csum",
+	.init    = csum_handler_init,
+	.process = csum_handler_process,
+};
+
+static const struct xsk_handler *builtin_handlers[] = {
+	&default_handler,
+	&l2fwd_handler,
+	&linearize_handler,
+	&classify_handler,
+	&csum_handler,
+	NULL
+};
+
+/* Find a built-in handler by name, or else dlopen() it as a shared object */
+static const struct xsk_handler *load_handler(const char *name)
 {
-	double period_ = 0;
-	__u64 period = 0;
+	const struct xsk_handler *h;
+	int i;
 
-	period = r->timestamp - p->timestamp;
-	if (period > 0)
-		period_ = ((double) period / NANOSEC_PER_SEC);
+	if (!name[0])
+		return fwd_mode() ? &l2fwd_handler : &default_handler;
 
-	return period_;
+	for (i = 0; builtin_handlers[i]; i++)
+		if (!strcmp(builtin_handlers[i]->name, name))
+			return builtin_handlers[i];
+
+	handler_dl = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+	if (!handler_dl) {
+		fprintf(stderr, "ERROR: Can't load handler \"%s\": %s\n",
+			name, dlerror());
+		return NULL;
+	}
+
+	h = dlsym(handler_dl, XSK_HANDLER_SYM);
+	if (!h || !h->process) {
+		fprintf(stderr, "ERROR: No valid symbol %s in \"%s\"\n",
+			XSK_HANDLER_SYM, name);
+		dlclose(handler_dl);
+		handler_dl = NULL;
+		return NULL;
+	}
+	return h;
 }
 
-static void stats_print(struct stats_record *stats_rec,
-			struct stats_record *stats_prev)
+/* Packets with XSK_VERDICT_PASS are written to a TAP device, which injects
+ * them into the kernel stack as if received on that device.
+ */
+static int open_pass_dev(const char *ifname)
 {
-	uint64_t packets, bytes;
+	struct ifreq ifr;
+	int fd, sock;
+
+	fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0)
+		goto error;
+
+	/* Bring it up */
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		goto error;
+	if (ioctl(sock, SIOCGIFFLAGS, &ifr) == 0) {
+		ifr.ifr_flags |= IFF_UP;
+		ioctl(sock, SIOCSIFFLAGS, &ifr);
+	}
+	close(sock);
+	return fd;
+
+error:
+	close(fd);
+	return -errno;
+}
+
+void pass_packet(const struct xsk_pkt *pkt)
+{
+	struct iovec iov[MAX_FRAGS];
+	uint32_t i;
+
+	iov[0].iov_base = pkt->data;
+	iov[0].iov_len = pkt->len;
+	for (i = 0; i < pkt->nr_frags && i + 1 < MAX_FRAGS; i++) {
+		iov[i + 1].iov_base = pkt->frags[i].data;
+		iov[i + 1].iov_len = pkt->frags[i].len;
+	}
+
+	/* On error, e.g. with the TAP device down, the packet is dropped */
+	if (writev(pass_fd, iov, i + 1) < 0)
+		return;
+}
+
+/* Fill in the L4 checksum a handler asked for with csum_start, over all
+ * buffers of the packet. The checksum field holds the pseudo header sum.
+ */
+void pkt_csum_complete(const struct xsk_pkt *pkt)
+{
+	uint32_t sum, off, i;
+	__sum16 check;
+
+	if (pkt->csum_start + pkt->csum_offset + sizeof(check) > pkt->len)
+		return;
+
+	off = pkt->len - pkt->csum_start;
+	sum = csum_partial(pkt->data + pkt->csum_start, off, 0);
+	for (i = 0; i < pkt->nr_frags; i++) {
+		sum = csum_block_add(sum, csum_partial(pkt->frags[i].data,
+						       pkt->frags[i].len, 0),
+				     off);
+		off += pkt->frags[i].len;
+	}
+
+	check = csum_fold(sum);
+	memcpy(pkt->data + pkt->csum_start + pkt->csum_offset, &check,
+	       sizeof(check));
+}
+
+/* Have the NIC fill in the checksum through the TX metadata in front of the
+ * packet, if there is room for it in the frame, else do it in software.
+ */
+static void pkt_tx_csum(const struct xsk_pkt *pkt, struct xdp_desc *desc)
+{
+	struct xsk_tx_metadata *md;
+
+	if (!tx_csum_offload ||
+	    (pkt->addr & (cfg.xsk_frame_size - 1)) < sizeof(*md)) {
+		pkt_csum_complete(pkt);
+		return;
+	}
+
+	md = (struct xsk_tx_metadata *)pkt->data - 1;
+	memset(md, 0, sizeof(*md));
+	md->flags = XDP_TXMD_FLAGS_CHECKSUM;
+	md->request.csum_start = pkt->csum_start;
+	md->request.csum_offset = pkt->csum_offset;
+	desc->options |= XDP_TX_METADATA;
+}
+
+/* Turn a packet into its chain of TX descriptors, all but the last one
+ * flagged XDP_PKT_CONTD. Returns the number of descriptors.
+ */
+static unsigned int pkt_to_descs(const struct xsk_pkt *pkt,
+				 struct xdp_desc *descs)
+{
+	uint32_t i;
+
+	descs[0].addr = pkt->addr;
+	descs[0].len = pkt->len;
+	descs[0].options = pkt->nr_frags ? XDP_PKT_CONTD : 0;
+	if (pkt->csum_start)
+		pkt_tx_csum(pkt, &descs[0]);
+
+	for (i = 0; i < pkt->nr_frags; i++) {
+		descs[i + 1].addr = pkt->frags[i].addr;
+		descs[i + 1].len = pkt->frags[i].len;
+		descs[i + 1].options = i + 1 < pkt->nr_frags ? XDP_PKT_CONTD : 0;
+	}
+	return pkt->nr_frags + 1;
+}
+
+static void free_pkt(struct xsk_socket_info *xsk, const struct xsk_pkt *pkt)
+{
+	uint32_t i;
+
+	xsk_free_umem_frame(xsk, pkt->addr);
+	for (i = 0; i < pkt->nr_frags; i++)
+		xsk_free_umem_frame(xsk, pkt->frags[i].addr);
+}
+
+/* Put a batch of frames on the TX ring of socket out with a single
+ * reserve/submit, so the shared producer pointer is only written once per
+ * batch. The calling worker's socket xsk is where the TX is accounted, and
+ * where frames that don't fit on the ring are freed to. A chain of
+ * XDP_PKT_CONTD descriptors is never split over two submits, as the kernel
+ * would glue the rest of a dropped packet to the next one.
+ */
+static void tx_submit_batch(struct xsk_socket_info *xsk,
+			    struct xsk_socket_info *out,
+			    const struct xdp_desc *descs, unsigned int n)
+{
+	unsigned int i, ntx, done = 0, packets = 0;
+	uint64_t bytes = 0;
+	uint32_t tx_idx = 0;
+
+	if (!n)
+		return;
+
+	pthread_spin_lock(&out->tx_lock);
+	while (done < n) {
+		ntx = n - done;
+		if (ntx > cfg.xsk_tx_batch)
+			ntx = cfg.xsk_tx_batch;
+
+		/* Reserve is all-or-nothing, check how much room there is */
+		if (xsk_prod_nb_free(&out->tx, ntx) < ntx)
+			ntx = xsk_prod_nb_free(&out->tx, ntx);
+		while (ntx && descs[done + ntx - 1].options & XDP_PKT_CONTD)
+			ntx--;
+		if (!ntx || xsk_ring_prod__reserve(&out->tx, ntx, &tx_idx) != ntx)
+			break;
+
+		for (i = 0; i < ntx; i++) {
+			*xsk_ring_prod__tx_desc(&out->tx, tx_idx++) = descs[done + i];
+			bytes += descs[done + i].len;
+			if (!(descs[done + i].options & XDP_PKT_CONTD))
+				packets++;
+		}
+
+		xsk_ring_prod__submit(&out->tx, ntx);
+		out->outstanding_tx += ntx;
+		done += ntx;
+	}
+	pthread_spin_unlock(&out->tx_lock);
+
+	stat_add(&xsk->stats.tx_packets, packets);
+	stat_add(&xsk->stats.tx_bytes, bytes);
+
+	/* Kick another worker's socket right away, it may be asleep in poll()
+	 * and only reaps its completions later */
+	if (out != xsk && done &&
+	    (cfg.xsk_busy_poll || !(cfg.xsk_bind_flags & XDP_USE_NEED_WAKEUP) ||
+	     xsk_ring_prod__needs_wakeup(&out->tx))) {
+		sendto(xsk_socket__fd(out->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+		stat_add(&xsk->stats.wakeups, 1);
+	}
+
+	/* No more transmit slots, drop the rest */
+	for (i = done, packets = 0; i < n; i++) {
+		xsk_free_umem_frame(xsk, descs[i].addr);
+		if (!(descs[i].options & XDP_PKT_CONTD))
+			packets++;
+	}
+	if (packets)
+		stat_add(&xsk->stats.tx_full_drops, packets);
+}
+
+/* Send the XSK_VERDICT_FWD packets of a batch, one TX batch per target */
+static void fwd_submit(struct xsk_socket_info *xsk, struct xsk_pkt *pkts,
+		       unsigned int n)
+{
+	struct xdp_desc descs[MAX_BATCH_SIZE];
+	unsigned int i, nfwd;
+	uint32_t target;
+
+	for (;;) {
+		target = UINT32_MAX;
+		nfwd = 0;
+
+		for (i = 0; i < n; i++) {
+			if (pkts[i].verdict != XSK_VERDICT_FWD)
+				continue;
+			if (target == UINT32_MAX)
+				target = pkts[i].fwd_xsk;
+			if (pkts[i].fwd_xsk != target)
+				continue;
+
+			nfwd += pkt_to_descs(&pkts[i], &descs[nfwd]);
+			pkts[i].verdict = XSK_VERDICT_DROP; /* Done with it */
+		}
+
+		if (!nfwd)
+			break;
+
+		/* Frames can only move between sockets on the same UMEM */
+		if (target >= (uint32_t)num_xsks ||
+		    xsks[target]->umem != xsk->umem) {
+			for (i = 0; i < nfwd; i++)
+				xsk_free_umem_frame(xsk, descs[i].addr);
+			continue;
+		}
+
+		tx_submit_batch(xsk, xsks[target], descs, nfwd);
+	}
+}
+
+/* When a packet came in, for the RX to TX latency histogram: the time the
+ * XDP program saw it, unless the metadata holds a NIC clock timestamp, else
+ * t_batch from before the RX ring was read.
+ */
+static uint64_t pkt_rx_time(const struct xsk_pkt *pkt, uint64_t t_batch)
+{
+	if (pkt->meta && !(pkt->meta->flags & XSK_META_HW_TIMESTAMP))
+		return pkt->meta->rx_timestamp;
+	return t_batch;
+}
+
+/* One latency sample for each of the n packets sent on, with RX times t_rx */
+void lat_record(struct xsk_socket_info *xsk, const uint64_t *t_rx,
+		unsigned int n)
+{
+	unsigned int i;
+	uint64_t now;
+
+	if (!n)
+		return;
+
+	now = gettime();
+	for (i = 0; i < n; i++)
+		stat_add(&xsk->stats.latency[lat_hist_index(now > t_rx[i] ?
+							    now - t_rx[i] : 0)], 1);
+}
+
+static void handle_receive_packets(struct xsk_socket_info *xsk)
+{
+	struct xdp_desc tx_descs[MAX_BATCH_SIZE];
+	struct xsk_frag frags[MAX_BATCH_SIZE];
+	struct xsk_pkt pkts[MAX_BATCH_SIZE];
+	unsigned int rcvd, ndescs, i, nfrags = 0, npkts = 0, ntx = 0, nlat = 0;
+	uint64_t bytes = 0, pkt_bytes = 0, t_batch = 0;
+	uint64_t t_rx[MAX_BATCH_SIZE];
+	struct xsk_pkt *pkt = NULL;
+	bool fwd = false;
+	uint32_t idx_rx = 0;
+
+	/* The turnaround time is only shown with the stats output. Without
+	 * an XDP timestamp, a packet counts as received when we get to it. */
+	if (verbose)
+		t_batch = gettime();
+
+	/* Refill before looking at RX, the kernel can't deliver anything to
+	 * us once it has run out of fill ring buffers */
+	xsk_refill_fill_ring(xsk);
+
+	ndescs = xsk_ring_cons__peek(&xsk->rx, cfg.xsk_rx_batch, &idx_rx);
+
+	/* Gather the descriptors into packets. With XDP_USE_SG, a packet
+	 * continues in the next descriptor as long as XDP_PKT_CONTD is set. */
+	for (i = 0, rcvd = 0; i < ndescs; i++) {
+		const struct xdp_desc *desc;
+		uint8_t *data;
+
+		desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+		data = xsk_umem__get_data(xsk->umem->buffer, desc->addr);
+
+		if (!pkt) {
+			pkt = &pkts[npkts];
+			pkt->addr = desc->addr;
+			pkt->len = desc->len;
+			pkt->data = data;
+			pkt->fwd_xsk = 0;
+			pkt->verdict = XSK_VERDICT_DROP;
+			pkt->nr_frags = 0;
+			pkt->frags = &frags[nfrags];
+			pkt->meta = NULL;
+			pkt->csum_start = 0;
+			pkt->csum_offset = 0;
+			if (cfg.xsk_rx_metadata)
+				pkt->meta = (struct xsk_meta *)data - 1;
+		} else {
+			frags[nfrags].addr = desc->addr;
+			frags[nfrags].len = desc->len;
+			frags[nfrags].data = data;
+			nfrags++;
+			pkt->nr_frags++;
+		}
+		pkt_bytes += desc->len;
+
+		if (!(desc->options & XDP_PKT_CONTD)) {
+			npkts++;
+			rcvd = i + 1;
+			bytes += pkt_bytes;
+			pkt_bytes = 0;
+			pkt = NULL;
+		}
+	}
+
+	/* Leave the start of a packet whose last buffers the kernel hasn't
+	 * produced yet (or that didn't fit in the batch) for the next round */
+	if (rcvd < ndescs)
+		xsk_ring_cons__cancel(&xsk->rx, ndescs - rcvd);
+
+	if (!rcvd) {
+		/* Nothing received: in busy-poll mode, or if the kernel ran
+		 * out of fill ring buffers and asked for a wakeup, let it run
+		 * the RX processing. In poll() mode, poll() does this for us.
+		 */
+		if (!cfg.xsk_poll_mode &&
+		    (cfg.xsk_busy_poll ||
+		     xsk_ring_prod__needs_wakeup(&xsk->fq))) {
+			recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0,
+				 MSG_DONTWAIT, NULL, NULL);
+			stat_add(&xsk->stats.wakeups, 1);
+		}
+
+		/* Others may have forwarded frames to us */
+		complete_tx(xsk);
+		return;
+	}
+
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+	stat_add(&xsk->stats.rx_packets, npkts);
+	stat_add(&xsk->stats.rx_bytes, bytes);
+	stat_add(&xsk->stats.rx_batches[batch_hist_index(npkts)], 1);
+
+	handler->process(&xsk->handler_ctx, pkts, npkts);
+
+	/* Act on the verdicts, staging replies for one TX batch */
+	for (i = 0; i < npkts; i++) {
+		switch (pkts[i].verdict) {
+		case XSK_VERDICT_TX:
+			ntx += pkt_to_descs(&pkts[i], &tx_descs[ntx]);
+			if (verbose)
+				t_rx[nlat++] = pkt_rx_time(&pkts[i], t_batch);
+			break;
+		case XSK_VERDICT_FWD:
+			fwd = true;
+			if (verbose)
+				t_rx[nlat++] = pkt_rx_time(&pkts[i], t_batch);
+			break;
+		case XSK_VERDICT_PASS:
+			if (pass_fd >= 0)
+				pass_packet(&pkts[i]);
+			/* fall-through */
+		case XSK_VERDICT_DROP:
+		default:
+			free_pkt(xsk, &pkts[i]);
+			break;
+		}
+	}
+
+	tx_submit_batch(xsk, xsk, tx_descs, ntx);
+	if (fwd)
+		fwd_submit(xsk, pkts, npkts);
+
+	lat_record(xsk, t_rx, nlat);
+
+	/* Do we need to wake up the kernel for transmission */
+	complete_tx(xsk);
+}
+
+/* Wait on park_cond with a timeout, as nobody signals global_exit */
+static void park_wait(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 100 * 1000000;
+	if (ts.tv_nsec >= NANOSEC_PER_SEC) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NANOSEC_PER_SEC;
+	}
+	pthread_cond_timedwait(&park_cond, &park_lock, &ts);
+}
+
+/* Sit out a reconfiguration between two batches, holding no frames */
+static void worker_park(struct xsk_socket_info *xsk)
+{
+	pthread_mutex_lock(&park_lock);
+	nr_parked++;
+	pthread_cond_broadcast(&park_cond);
+	while (park_request && !xsk->stop && !global_exit)
+		park_wait();
+	nr_parked--;
+	pthread_mutex_unlock(&park_lock);
+}
+
+bool worker_running(struct xsk_socket_info *xsk)
+{
+	if (__atomic_load_n(&park_request, __ATOMIC_ACQUIRE))
+		worker_park(xsk);
+	return !global_exit && !__atomic_load_n(&xsk->stop, __ATOMIC_RELAXED);
+}
+
+/* Stop all workers at a batch boundary. Packets keep arriving meanwhile,
+ * the RX and fill rings buffer them until unpark_workers(). In poll() mode
+ * this can take up to the poll timeout.
+ */
+static int park_workers(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&park_lock);
+	__atomic_store_n(&park_request, true, __ATOMIC_RELEASE);
+	while (nr_parked < num_xsks && !global_exit)
+		park_wait();
+	if (global_exit) {
+		__atomic_store_n(&park_request, false, __ATOMIC_RELEASE);
+		ret = -ECANCELED;
+	}
+	pthread_mutex_unlock(&park_lock);
+	return ret;
+}
+
+static void unpark_workers(void)
+{
+	pthread_mutex_lock(&park_lock);
+	__atomic_store_n(&park_request, false, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+}
+
+static void rx_and_process(struct config *cfg,
+			   struct xsk_socket_info *xsk_socket)
+{
+	struct pollfd fds[2];
+	int ret, nfds = 1;
+
+	memset(fds, 0, sizeof(fds));
+	fds[0].fd = xsk_socket__fd(xsk_socket->xsk);
+	fds[0].events = POLLIN;
+
+	while (worker_running(xsk_socket)) {
+		if (cfg->xsk_poll_mode) {
+			/* Signals are only delivered to the main thread, so use
+			 * a timeout for the workers to notice global_exit */
+			ret = poll(fds, nfds, 1000);
+			stat_add(&xsk_socket->stats.wakeups, 1);
+			if (ret <= 0 || ret > 1)
+				continue;
+		}
+		handle_receive_packets(xsk_socket);
+	}
+}
+
+/* Write the traffic generator's UDP packet for flow 0 into every frame of
+ * the UMEM once, so sending only has to patch the flow fields.
+ */
+static void tx_only_fill_umem(struct xsk_umem_info *umem,
+			      const uint8_t *src_mac, const uint8_t *dst_mac)
+{
+	uint32_t i, len = cfg.xsk_tx_pkt_size;
+	struct ethhdr *eth;
+	struct udphdr *udph;
+	struct iphdr *iph;
+	uint8_t *pkt;
+	uint32_t sum;
+
+	for (i = 0; i < umem->pool.nr_frames; i++) {
+		pkt = xsk_umem__get_data(umem->buffer,
+					 (uint64_t)i * umem->frame_size);
+		eth = (struct ethhdr *)pkt;
+		iph = (struct iphdr *)(eth + 1);
+		udph = (struct udphdr *)(iph + 1);
+
+		if (i > 0) {
+			memcpy(pkt, umem->buffer, len);
+			continue;
+		}
+
+		memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+		memcpy(eth->h_source, src_mac, ETH_ALEN);
+		eth->h_proto = htons(ETH_P_IP);
+
+		memset(iph, 0, sizeof(*iph));
+		iph->version = 4;
+		iph->ihl = sizeof(*iph) / 4;
+		iph->tot_len = htons(len - sizeof(*eth));
+		iph->frag_off = htons(0x4000); /* DF */
+		iph->ttl = 64;
+		iph->protocol = IPPROTO_UDP;
+		iph->saddr = htonl(TX_SRC_IP);
+		iph->daddr = htonl(TX_DST_IP);
+		iph->check = csum_fold(csum_partial(iph, sizeof(*iph), 0));
+
+		udph->source = htons(TX_SRC_PORT);
+		udph->dest = htons(TX_DST_PORT);
+		udph->len = htons(len - sizeof(*eth) - sizeof(*iph));
+		udph->check = 0;
+		memset(udph + 1, 0xa5, len - sizeof(*eth) - sizeof(*iph) -
+		       sizeof(*udph));
+
+		/* Pseudo header, then UDP header and payload */
+		sum = csum_tcpudp_ipv4(iph->saddr, iph->daddr,
+				       ntohs(udph->len), IPPROTO_UDP, 0);
+		udph->check = csum_fold(csum_partial(udph, ntohs(udph->len), sum));
+		if (!udph->check)
+			udph->check = 0xffff;
+	}
+}
+
+/* Rewrite a frame for another flow, fixing up both checksums incrementally
+ * from the flow the frame was last sent for.
+ */
+static void tx_only_set_flow(uint8_t *pkt, uint32_t flow)
+{
+	struct iphdr *iph = (struct iphdr *)(pkt + sizeof(struct ethhdr));
+	struct udphdr *udph = (struct udphdr *)(iph + 1);
+	__be32 saddr = htonl(TX_SRC_IP + flow % 254);
+	__be16 sport = htons(TX_SRC_PORT + flow);
+
+	if (iph->saddr != saddr) {
+		csum_replace4(&iph->check, iph->saddr, saddr);
+		csum_replace4(&udph->check, iph->saddr, saddr);
+		iph->saddr = saddr;
+	}
+	if (udph->source != sport) {
+		csum_replace2(&udph->check, udph->source, sport);
+		udph->source = sport;
+	}
+}
+
+/* Traffic generator worker: send from pre-built frames, at the configured
+ * rate (shared evenly by the workers) or as fast as the TX ring drains.
+ */
+static void tx_only(struct xsk_socket_info *xsk)
+{
+	struct xdp_desc descs[MAX_BATCH_SIZE];
+	uint64_t frames[MAX_BATCH_SIZE];
+	uint64_t rate, now, last;
+	double credit = 0;
+	uint32_t i, n;
+
+	rate = cfg.xsk_tx_rate / num_xsks;
+	if (cfg.xsk_tx_rate && !rate)
+		rate = 1;
+	last = gettime();
+
+	while (worker_running(xsk)) {
+		complete_tx(xsk);
+
+		n = cfg.xsk_tx_batch;
+		if (rate) {
+			now = gettime();
+			credit += (double)(now - last) * rate / NANOSEC_PER_SEC;
+			last = now;
+			if (credit > n)
+				credit = n;
+			n = credit;
+			if (!n)
+				continue;
+		}
+
+		/* Only take frames the TX ring has room for */
+		if (xsk_prod_nb_free(&xsk->tx, n) < n)
+			n = xsk_prod_nb_free(&xsk->tx, n);
+		n = xsk_alloc_umem_frames(xsk, frames, n);
+		if (!n)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			tx_only_set_flow(xsk_umem__get_data(xsk->umem->buffer,
+							    frames[i]),
+					 xsk->tx_flow);
+			if (++xsk->tx_flow == cfg.xsk_tx_flows)
+				xsk->tx_flow = 0;
+
+			descs[i].addr = frames[i];
+			descs[i].len = cfg.xsk_tx_pkt_size;
+			descs[i].options = 0;
+		}
+
+		tx_submit_batch(xsk, xsk, descs, n);
+		if (rate)
+			credit -= n;
+	}
+}
+
+static void *xsk_worker(void *arg)
+{
+	struct xsk_socket_info *xsk = arg;
+
+	if (cfg.xsk_af_packet)
+		pkt_rx_and_process(xsk);
+	else if (cfg.xsk_tx_only)
+		tx_only(xsk);
+	else
+		rx_and_process(&cfg, xsk);
+	return NULL;
+}
+
+/* Parse a CPU list like "0-3,8" into cpus[], returns the number of CPUs
+ * found or -1 on a malformed list.
+ */
+static int parse_cpu_list(const char *list, int *cpus, int max)
+{
+	char buf[sizeof(cfg.xsk_cpu_list)];
+	char *tok, *saveptr;
+	int first, last, n = 0;
+
+	strncpy(buf, list, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (tok = strtok_r(buf, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		switch (sscanf(tok, "%d-%d", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -1;
+		}
+		if (first < 0 || last < first)
+			return -1;
+
+		while (first <= last && n < max)
+			cpus[n++] = first++;
+	}
+	return n;
+}
+
+/* Tell each handler context where its socket is in xsks[] */
+static void update_handler_ctx(void)
+{
+	struct xsk_socket_info *xsk;
+	int i;
+
+	for (i = 0; i < num_xsks; i++) {
+		xsk = xsks[i];
+		xsk->handler_ctx.xsk_index = i;
+		xsk->handler_ctx.num_xsks = num_xsks;
+		xsk->handler_ctx.ifindex = xsk->ifindex;
+		xsk->handler_ctx.peer_xsk = fwd_mode() ? (i ^ 1) : -1;
+		xsk->handler_ctx.queue_id = xsk->queue_id;
+		xsk->handler_ctx.frame_size = xsk->umem ?
+					      xsk->umem->frame_size : 0;
+		xsk->handler_ctx.priv = handler_priv;
+	}
+}
+
+static int start_worker(struct xsk_socket_info *xsk, int cpu_idx)
+{
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int ret;
+
+	pthread_attr_init(&attr);
+	if (nr_worker_cpus) {
+		xsk->cpu = worker_cpus[cpu_idx % nr_worker_cpus];
+		CPU_ZERO(&cpuset);
+		CPU_SET(xsk->cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+	}
+
+	ret = pthread_create(&xsk->thread, &attr, xsk_worker, xsk);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		fprintf(stderr, "ERROR: Failed creating worker for %s queue %d "
+			"\"%s\"\n", xsk->ifname, xsk->queue_id, strerror(ret));
+		return -ret;
+	}
+
+	if (verbose)
+		printf("%s queue %d: worker on CPU %d\n", xsk->ifname,
+		       xsk->queue_id, xsk->cpu);
+	return 0;
+}
+
+static int start_workers(void)
+{
+	int i, ret;
+
+	if (cfg.xsk_cpu_list[0]) {
+		nr_worker_cpus = parse_cpu_list(cfg.xsk_cpu_list, worker_cpus,
+						MAX_XSKS);
+		if (nr_worker_cpus <= 0) {
+			fprintf(stderr, "ERROR: Invalid --cpu-list \"%s\"\n",
+				cfg.xsk_cpu_list);
+			return -EINVAL;
+		}
+	}
+
+	update_handler_ctx();
+	for (i = 0; i < num_xsks; i++) {
+		ret = start_worker(xsks[i], i);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static double calc_period(struct stats_record *r, struct stats_record *p)
+{
+	double period_ = 0;
+	__u64 period = 0;
+
+	period = r->timestamp - p->timestamp;
+	if (period > 0)
+		period_ = ((double) period / NANOSEC_PER_SEC);
+
+	return period_;
+}
+
+/* Value below which pct percent of the n samples in hist fall */
+static uint64_t lat_hist_percentile(const uint64_t *hist, uint64_t n,
+				    double pct)
+{
+	uint64_t sum = 0, target = n * pct / 100;
+	unsigned int i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum > target)
+			break;
+	}
+	return lat_hist_value(i < LAT_HIST_BUCKETS ? i : LAT_HIST_BUCKETS - 1);
+}
+
+static void stats_print(struct stats_record *stats_rec,
+			struct stats_record *stats_prev)
+{
+	uint64_t packets, bytes, batches, hist[LAT_HIST_BUCKETS];
 	double period;
 	double pps; /* packets per sec */
 	double bps; /* bits per sec */
+	unsigned int i;
+
+	char *fmt = "%-12s %'11lld pkts (%'10.0f pps)"
+		" %'11lld Kbytes (%'6.0f Mbits/s)"
+		" period:%f\n";
+
+	period = calc_period(stats_rec, stats_prev);
+	if (period == 0)
+		period = 1;
+
+	packets = stats_rec->rx_packets - stats_prev->rx_packets;
+	pps     = packets / period;
+
+	bytes   = stats_rec->rx_bytes   - stats_prev->rx_bytes;
+	bps     = (bytes * 8) / period / 1000000;
+
+	printf(fmt, "AF_XDP RX:", stats_rec->rx_packets, pps,
+	       stats_rec->rx_bytes / 1000 , bps,
+	       period);
+
+	packets = stats_rec->tx_packets - stats_prev->tx_packets;
+	pps     = packets / period;
+
+	bytes   = stats_rec->tx_bytes   - stats_prev->tx_bytes;
+	bps     = (bytes * 8) / period / 1000000;
+
+	printf(fmt, "       TX:", stats_rec->tx_packets, pps,
+	       stats_rec->tx_bytes / 1000 , bps,
+	       period);
+
+	printf("%-12s %'10.0f %s/s %'10.0f tx-full-drops/s"
+	       " %'10.0f wakeups/s\n", "",
+	       cfg.xsk_af_packet ?
+	       (stats_rec->ring_drops - stats_prev->ring_drops) / period :
+	       (stats_rec->fill_empty - stats_prev->fill_empty) / period,
+	       cfg.xsk_af_packet ? "ring-drops" : "fill-empty",
+	       (stats_rec->tx_full_drops - stats_prev->tx_full_drops) / period,
+	       (stats_rec->wakeups - stats_prev->wakeups) / period);
+
+	for (i = 0, batches = 0; i < BATCH_HIST_BUCKETS; i++)
+		batches += stats_rec->rx_batches[i] - stats_prev->rx_batches[i];
+	if (batches) {
+		printf("%-12s", "  RX batch:");
+		for (i = 0; i < BATCH_HIST_BUCKETS; i++)
+			printf(" %u+:%.0f%%", 1U << i,
+			       100.0 * (stats_rec->rx_batches[i] -
+					stats_prev->rx_batches[i]) / batches);
+		printf("\n");
+	}
+
+	for (i = 0, packets = 0; i < LAT_HIST_BUCKETS; i++) {
+		hist[i] = stats_rec->latency[i] - stats_prev->latency[i];
+		packets += hist[i];
+	}
+	if (packets) {
+		for (i = LAT_HIST_BUCKETS; i > 0 && !hist[i - 1]; i--)
+			;
+		printf("%-12s p50 %'lu p90 %'lu p99 %'lu p99.9 %'lu max %'lu ns\n",
+		       "  RX->TX:",
+		       lat_hist_percentile(hist, packets, 50),
+		       lat_hist_percentile(hist, packets, 90),
+		       lat_hist_percentile(hist, packets, 99),
+		       lat_hist_percentile(hist, packets, 99.9),
+		       lat_hist_value(i - 1));
+	}
+
+	/* Sockets silently running in the slower copy mode stand out here */
+	if (cfg.xsk_af_packet) {
+		printf("%-12s AF_PACKET (%d sockets)\n\n", "  mode:", num_xsks);
+		return;
+	}
+	for (i = 0, packets = 0; i < (unsigned int)num_xsks; i++)
+		packets += xsks[i]->zero_copy;
+	printf("%-12s %s (%lu of %d sockets zero-copy)\n", "  mode:",
+	       packets == (uint64_t)num_xsks ? "zero-copy" :
+	       packets ? "mixed" : "copy", packets, num_xsks);
+
+	printf("\n");
+}
+
+/* Consistent enough copy of a worker's counters: each counter is read
+ * atomically, but not all of them at the same instant */
+static void stats_snapshot(const struct stats_record *s,
+			   struct stats_record *rec)
+{
+	unsigned int i;
+
+	rec->rx_packets    = stat_read(&s->rx_packets);
+	rec->rx_bytes      = stat_read(&s->rx_bytes);
+	rec->tx_packets    = stat_read(&s->tx_packets);
+	rec->tx_bytes      = stat_read(&s->tx_bytes);
+	rec->fill_empty    = stat_read(&s->fill_empty);
+	rec->tx_full_drops = stat_read(&s->tx_full_drops);
+	rec->wakeups       = stat_read(&s->wakeups);
+	rec->ring_drops    = stat_read(&s->ring_drops);
+	for (i = 0; i < BATCH_HIST_BUCKETS; i++)
+		rec->rx_batches[i] = stat_read(&s->rx_batches[i]);
+	for (i = 0; i < LAT_HIST_BUCKETS; i++)
+		rec->latency[i] = stat_read(&s->latency[i]);
+}
+
+static void stats_sum(struct stats_record *rec, const struct stats_record *s)
+{
+	unsigned int j;
+
+	rec->rx_packets    += s->rx_packets;
+	rec->rx_bytes      += s->rx_bytes;
+	rec->tx_packets    += s->tx_packets;
+	rec->tx_bytes      += s->tx_bytes;
+	rec->fill_empty    += s->fill_empty;
+	rec->tx_full_drops += s->tx_full_drops;
+	rec->wakeups       += s->wakeups;
+	rec->ring_drops    += s->ring_drops;
+	for (j = 0; j < BATCH_HIST_BUCKETS; j++)
+		rec->rx_batches[j] += s->rx_batches[j];
+	for (j = 0; j < LAT_HIST_BUCKETS; j++)
+		rec->latency[j] += s->latency[j];
+}
+
+/* Counters of sockets removed by del-queue, so the totals don't go back */
+static struct stats_record retired_stats;
+
+/* Sum up the per-worker counters into one record */
+static void stats_collect(struct stats_record *rec)
+{
+	struct stats_record s;
+	int i;
+
+	*rec = retired_stats;
+	rec->timestamp = gettime();
+
+	for (i = 0; i < num_xsks; i++) {
+		stats_snapshot(&xsks[i]->stats, &s);
+		stats_sum(rec, &s);
+	}
+}
+
+/* With several queues, show how RSS spreads the load over the workers */
+static void stats_print_queues(uint64_t timestamp)
+{
+	struct stats_record rec, *prev;
+	double period;
+	int i;
+
+	for (i = 0; i < num_xsks; i++) {
+		prev = &xsks[i]->prev_stats;
+
+		stats_snapshot(&xsks[i]->stats, &rec);
+		rec.timestamp = timestamp;
+		period = calc_period(&rec, prev);
+		if (period == 0)
+			period = 1;
+
+		printf("  %-10s queue %-3d %-9s  RX %'10.0f pps  TX %'10.0f pps"
+		       "  drops %'8.0f/s\n",
+		       xsks[i]->ifname, xsks[i]->queue_id,
+		       cfg.xsk_af_packet ? "af_packet" :
+		       xsks[i]->zero_copy ? "zero-copy" : "copy",
+		       (rec.rx_packets - prev->rx_packets) / period,
+		       (rec.tx_packets - prev->tx_packets) / period,
+		       (rec.tx_full_drops - prev->tx_full_drops) / period);
+		*prev = rec;
+	}
+	printf("\n");
+}
+
+static void *stats_poll(void *arg)
+{
+	unsigned int interval = 2;
+	static struct stats_record stats;
+	static struct stats_record previous_stats = { 0 };
+	int i;
+
+	previous_stats.timestamp = gettime();
+	for (i = 0; i < num_xsks; i++)
+		xsks[i]->prev_stats.timestamp = previous_stats.timestamp;
+
+	/* Trick to pretty printf with thousands separators use %' */
+	setlocale(LC_NUMERIC, "en_US");
+
+	while (!global_exit) {
+		sleep(interval);
+		pthread_mutex_lock(&xsks_lock);
+		stats_collect(&stats);
+		stats_print(&stats, &previous_stats);
+		if (num_xsks > 1)
+			stats_print_queues(stats.timestamp);
+		pthread_mutex_unlock(&xsks_lock);
+		previous_stats = stats;
+	}
+	return NULL;
+}
+
+/* Only async-signal-safe calls in here, main() does the actual shutdown.
+ * A second signal gives up on an orderly shutdown.
+ */
+static void exit_application(int signal)
+{
+	if (global_exit)
+		_exit(EXIT_FAIL);
+	global_exit = 1;
+}
+
+static void unload_programs(void)
+{
+	struct config unload_cfg = cfg;
+	int err;
+
+	unload_cfg.unload_all = true;
+	err = do_unload(&unload_cfg);
+	if (err) {
+		fprintf(stderr, "Couldn't detach XDP program on iface '%s' : (%d)\n",
+			cfg.ifname, err);
+	}
+
+	if (fwd_mode()) {
+		unload_cfg.ifindex = cfg.redirect_ifindex;
+		unload_cfg.ifname = cfg.redirect_ifname;
+		do_unload(&unload_cfg);
+	}
+}
+
+/* The XDP metadata kfuncs need a program bound to the device. libxdp
+ * normally attaches programs through its multiprog dispatcher, which isn't
+ * bound itself, and the kernel won't attach a bound program to an unbound
+ * one. SKB mode takes no bound programs either. That leaves native mode
+ * with the dispatcher skipped (LIBXDP_SKIP_DISPATCHER=1).
+ */
+static bool dev_bound_possible(void)
+{
+	return cfg.xsk_rx_metadata && cfg.attach_mode != XDP_MODE_SKB &&
+	       getenv("LIBXDP_SKIP_DISPATCHER");
+}
+
+/* Open program progname of file, or its device bound variant <progname>_hw
+ * if dev_bound and the file has one, see af_xdp_kern.c
+ */
+static struct xdp_program *open_custom_program(const char *file,
+						const char *progname,
+						int ifindex, bool dev_bound)
+{
+	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts);
+	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
+	struct bpf_program *bpf_prog;
+	char errmsg[1024], hw_name[128];
+	struct bpf_object *obj;
+	struct xdp_program *p;
+	int err;
+
+	if (progname && progname[0] != 0) {
+		xdp_opts.open_filename = file;
+		xdp_opts.prog_name = progname;
+		xdp_opts.opts = &opts;
+
+		p = xdp_program__create(&xdp_opts);
+	} else {
+		p = xdp_program__open_file(file, NULL, &opts);
+	}
+	err = libxdp_get_error(p);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "ERR: loading program: %s\n", errmsg);
+		return NULL;
+	}
+
+	obj = xdp_program__bpf_obj(p);
+	if (dev_bound) {
+		snprintf(hw_name, sizeof(hw_name), "%s_hw", xdp_program__name(p));
+		if (bpf_object__find_program_by_name(obj, hw_name)) {
+			xdp_program__close(p);
+			return open_custom_program(file, hw_name, ifindex, true);
+		}
+	}
+
+	/* Only load the one program, the kernel would refuse the variant
+	 * with the kfuncs unless it is bound to the device */
+	bpf_object__for_each_program(bpf_prog, obj)
+		bpf_program__set_autoload(bpf_prog,
+					  !strcmp(bpf_program__name(bpf_prog),
+						  xdp_program__name(p)));
+
+	/* Multi-buffer sockets only get packets from a frags aware program */
+	if (cfg.xsk_bind_flags & XDP_USE_SG)
+		xdp_program__set_xdp_frags_support(p, true);
+
+	/* The XDP metadata kfuncs only reach the driver from a program bound
+	 * to the device */
+	if (dev_bound) {
+		bpf_prog = bpf_object__find_program_by_name(obj,
+							    xdp_program__name(p));
+		if (bpf_prog) {
+			bpf_program__set_ifindex(bpf_prog, ifindex);
+			bpf_program__set_flags(bpf_prog,
+					       bpf_program__flags(bpf_prog) |
+					       BPF_F_XDP_DEV_BOUND_ONLY);
+		}
+	}
+	return p;
+}
+
+static struct xdp_program *load_custom_program(int ifindex, const char *ifname,
+					       int *map_fd)
+{
+	bool dev_bound = dev_bound_possible();
+	struct xdp_program *p;
+	struct bpf_map *map;
+	char errmsg[1024];
+	int err;
+
+	if (cfg.xsk_rx_metadata && !dev_bound)
+		printf("INFO: No device bound program through the libxdp dispatcher "
+		       "or in SKB mode, software RX metadata on iface '%s'\n",
+		       ifname);
+
+	p = open_custom_program(cfg.filename, cfg.progname, ifindex, dev_bound);
+	if (!p)
+		return NULL;
+
+	err = xdp_program__attach(p, ifindex, cfg.attach_mode, 0);
+	if (err && dev_bound) {
+		/* E.g. a kernel before v6.3, or libxdp fell back to SKB
+		 * mode: the metadata then has software values */
+		fprintf(stderr, "WARN: Can't attach device bound program on iface '%s', "
+			"no hardware RX metadata\n", ifname);
+		xdp_program__close(p);
+		p = open_custom_program(cfg.filename, cfg.progname, ifindex,
+					false);
+		if (!p)
+			return NULL;
+		err = xdp_program__attach(p, ifindex, cfg.attach_mode, 0);
+	}
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "Couldn't attach XDP program on iface '%s' : %s (%d)\n",
+			ifname, errmsg, err);
+		xdp_program__close(p);
+		return NULL;
+	}
+
+	/* We also need to load the xsks_map */
+	map = bpf_object__find_map_by_name(xdp_program__bpf_obj(p), "xsks_map");
+	*map_fd = bpf_map__fd(map);
+	if (*map_fd < 0) {
+		fprintf(stderr, "ERROR: no xsks map found: %s\n",
+			strerror(-*map_fd));
+		xdp_program__detach(p, ifindex, cfg.attach_mode, 0);
+		xdp_program__close(p);
+		return NULL;
+	}
+	return p;
+}
+
+static int parse_rule_proto(const char *str)
+{
+	char *end;
+	long proto;
+
+	if (!strcmp(str, "any"))
+		return 0;
+	if (!strcmp(str, "tcp"))
+		return IPPROTO_TCP;
+	if (!strcmp(str, "udp"))
+		return IPPROTO_UDP;
+	if (!strcmp(str, "icmp"))
+		return IPPROTO_ICMP;
+	if (!strcmp(str, "icmpv6"))
+		return IPPROTO_ICMPV6;
+
+	proto = strtol(str, &end, 0);
+	if (*end || proto < 0 || proto > 255)
+		return -1;
+	return proto;
+}
+
+static int parse_rule_port(const char *str, __u16 *port)
+{
+	char *end;
+	long val;
+
+	val = strtol(str, &end, 0);
+	if (*end || val < 0 || val > 65535)
+		return -1;
+	*port = htons(val);
+	return 0;
+}
 
-	char *fmt = "%-12s %'11lld pkts (%'10.0f pps)"
-		" %'11lld Kbytes (%'6.0f Mbits/s)"
-		" period:%f\n";
+/* IPv6, or IPv4 stored as an IPv4-mapped IPv6 address */
+static int parse_rule_addr(const char *str, __u32 addr[4])
+{
+	struct in_addr in4;
+
+	if (inet_pton(AF_INET6, str, addr) == 1)
+		return 0;
+	if (inet_pton(AF_INET, str, &in4) != 1)
+		return -1;
+	addr[0] = 0;
+	addr[1] = 0;
+	addr[2] = htonl(0xffff);
+	addr[3] = in4.s_addr;
+	return 0;
+}
 
-	period = calc_period(stats_rec, stats_prev);
-	if (period == 0)
-		period = 1;
+/* Fill the steering maps of af_xdp_kern.c from a file with one rule per line:
+ *
+ *   <action> <proto> [<dport> | <saddr> <sport> <daddr> <dport>] [queues <list>]
+ *
+ * where action is redirect, pass or drop, proto is tcp, udp, icmp, icmpv6,
+ * a protocol number or any, and list is like "0-3,8". Empty lines and
+ * everything after a '#' are ignored.
+ */
+static int load_rules(const char *file, struct xdp_program *p)
+{
+	struct bpf_object *obj = xdp_program__bpf_obj(p);
+	int flow_fd, port_fd, queues[MAX_XSKS];
+	char line[256], *tok[9], *saveptr, *c;
+	int i, n, ntok, proto, lineno = 0, nrules = 0;
+	struct xsk_flow_key flow;
+	struct xsk_port_key port;
+	struct xsk_rule rule;
+	FILE *f;
+	int err = 0;
+
+	flow_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xsk_flow_rules"));
+	port_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xsk_port_rules"));
+	if (flow_fd < 0 || port_fd < 0) {
+		fprintf(stderr, "ERROR: Program has no steering rule maps\n");
+		return -ENOENT;
+	}
 
-	packets = stats_rec->rx_packets - stats_prev->rx_packets;
-	pps     = packets / period;
+	f = fopen(file, "r");
+	if (!f) {
+		err = -errno;
+		fprintf(stderr, "ERROR: Can't open rules file %s \"%s\"\n",
+			file, strerror(errno));
+		return err;
+	}
 
-	bytes   = stats_rec->rx_bytes   - stats_prev->rx_bytes;
-	bps     = (bytes * 8) / period / 1000000;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+
+		ntok = 0;
+		for (c = strtok_r(line, " \t\n", &saveptr); c && ntok < 9;
+		     c = strtok_r(NULL, " \t\n", &saveptr))
+			tok[ntok++] = c;
+		if (!ntok)
+			continue;
+
+		memset(&rule, 0, sizeof(rule));
+		rule.rule_id = lineno;
+
+		/* Optional trailing queue list */
+		if (ntok >= 2 && !strcmp(tok[ntok - 2], "queues")) {
+			n = parse_cpu_list(tok[ntok - 1], queues, MAX_XSKS);
+			if (n <= 0)
+				goto invalid;
+			for (i = 0; i < n; i++) {
+				if (queues[i] >= XSK_RULE_MAX_QUEUES)
+					goto invalid;
+				rule.queue_mask |= 1ULL << queues[i];
+			}
+			ntok -= 2;
+		}
 
-	printf(fmt, "AF_XDP RX:", stats_rec->rx_packets, pps,
-	       stats_rec->rx_bytes / 1000 , bps,
-	       period);
+		if (!strcmp(tok[0], "redirect"))
+			rule.action = XSK_RULE_REDIRECT;
+		else if (!strcmp(tok[0], "pass"))
+			rule.action = XSK_RULE_PASS;
+		else if (!strcmp(tok[0], "drop"))
+			rule.action = XSK_RULE_DROP;
+		else
+			goto invalid;
+
+		proto = ntok >= 2 ? parse_rule_proto(tok[1]) : -1;
+		if (proto < 0)
+			goto invalid;
+
+		memset(&port, 0, sizeof(port));
+		memset(&flow, 0, sizeof(flow));
+		port.proto = proto;
+		flow.proto = proto;
+
+		switch (ntok) {
+		case 2:
+			err = bpf_map_update_elem(port_fd, &port, &rule, 0);
+			break;
+		case 3:
+			if (!proto || parse_rule_port(tok[2], &port.dport))
+				goto invalid;
+			err = bpf_map_update_elem(port_fd, &port, &rule, 0);
+			break;
+		case 6:
+			if (parse_rule_addr(tok[2], flow.saddr) ||
+			    parse_rule_port(tok[3], &flow.sport) ||
+			    parse_rule_addr(tok[4], flow.daddr) ||
+			    parse_rule_port(tok[5], &flow.dport))
+				goto invalid;
+			err = bpf_map_update_elem(flow_fd, &flow, &rule, 0);
+			break;
+		default:
+			goto invalid;
+		}
+		if (err) {
+			fprintf(stderr, "ERROR: Can't add rule %s:%d \"%s\"\n",
+				file, lineno, strerror(-err));
+			goto out;
+		}
+		nrules++;
+		continue;
 
-	packets = stats_rec->tx_packets - stats_prev->tx_packets;
-	pps     = packets / period;
+invalid:
+		fprintf(stderr, "ERROR: Invalid rule %s:%d\n", file, lineno);
+		err = -EINVAL;
+		goto out;
+	}
 
-	bytes   = stats_rec->tx_bytes   - stats_prev->tx_bytes;
-	bps     = (bytes * 8) / period / 1000000;
+	if (verbose)
+		printf("Loaded %d steering rules from %s\n", nrules, file);
+out:
+	fclose(f);
+	return err;
+}
 
-	printf(fmt, "       TX:", stats_rec->tx_packets, pps,
-	       stats_rec->tx_bytes / 1000 , bps,
-	       period);
+/* Fill the flow hash table of af_xdp_kern.c with the queues that have a
+ * socket on the device
+ */
+static int load_rss_table(struct xdp_program *p, int ifindex)
+{
+	struct bpf_object *obj = xdp_program__bpf_obj(p);
+	struct xsk_rss_table rss = {};
+	__u32 zero = 0;
+	int i, fd;
+
+	fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xsk_rss"));
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Program has no flow hash table\n");
+		return -ENOENT;
+	}
 
-	printf("\n");
+	for (i = 0; i < num_xsks && rss.nr_queues < XSK_RSS_MAX_QUEUES; i++)
+		if (xsks[i]->ifindex == ifindex)
+			rss.queues[rss.nr_queues++] = xsks[i]->queue_id;
+
+	if (bpf_map_update_elem(fd, &zero, &rss, 0)) {
+		fprintf(stderr, "ERROR: Can't update flow hash table \"%s\"\n",
+			strerror(errno));
+		return -errno;
+	}
+	return 0;
 }
 
-static void *stats_poll(void *arg)
+/* Replace the steering program old on a device by one from file, keeping
+ * its maps: the new program reuses xsks_map and the rule maps, so sockets
+ * and rules carry over. With the libxdp multiprog dispatcher, attaching the
+ * new program and detaching the old one each atomically replace the
+ * dispatcher, and in between the two run side by side on the same maps, so
+ * every packet is steered by one of them.
+ */
+static struct xdp_program *swap_custom_program(struct xdp_program *old,
+					       int ifindex, const char *ifname,
+					       const char *file,
+					       const char *progname,
+					       int *map_fd)
 {
-	unsigned int interval = 2;
-	struct xsk_socket_info *xsk = arg;
-	static struct stats_record previous_stats = { 0 };
+	static const char *shared_maps[] = {
+		"xsks_map", "xsk_flow_rules", "xsk_port_rules", "xsk_rss", NULL
+	};
+	struct bpf_object *old_obj = xdp_program__bpf_obj(old);
+	bool dev_bound = dev_bound_possible();
+	struct bpf_map *map, *old_map;
+	struct xdp_program *p;
+	char errmsg[1024];
+	int i, err;
+
+	for (;;) {
+		p = open_custom_program(file, progname, ifindex, dev_bound);
+		if (!p)
+			return NULL;
+
+		for (i = 0, err = 0; shared_maps[i] && !err; i++) {
+			map = bpf_object__find_map_by_name(xdp_program__bpf_obj(p),
+							   shared_maps[i]);
+			old_map = bpf_object__find_map_by_name(old_obj,
+							       shared_maps[i]);
+			if (map && old_map)
+				err = bpf_map__reuse_fd(map, bpf_map__fd(old_map));
+		}
+		if (!err)
+			err = xdp_program__attach(p, ifindex, cfg.attach_mode, 0);
+		if (!err)
+			break;
 
-	previous_stats.timestamp = gettime();
+		xdp_program__close(p);
+		if (!dev_bound) {
+			libxdp_strerror(err, errmsg, sizeof(errmsg));
+			fprintf(stderr, "ERR: Can't attach %s on iface '%s' : %s (%d)\n",
+				file, ifname, errmsg, err);
+			return NULL;
+		}
+		dev_bound = false; /* Like load_custom_program() */
+	}
 
-	/* Trick to pretty printf with thousands separators use %' */
-	setlocale(LC_NUMERIC, "en_US");
+	err = xdp_program__detach(old, ifindex, cfg.attach_mode, 0);
+	if (err) {
+		/* E.g. no multiprog in SKB mode on older kernels, where the
+		 * attach above would have failed already */
+		fprintf(stderr, "ERR: Can't detach old program from iface '%s' (%d)\n",
+			ifname, err);
+		xdp_program__detach(p, ifindex, cfg.attach_mode, 0);
+		xdp_program__close(p);
+		return NULL;
+	}
+	xdp_program__close(old);
 
-	while (!global_exit) {
-		sleep(interval);
-		xsk->stats.timestamp = gettime();
-		stats_print(&xsk->stats, &previous_stats);
-		previous_stats = xsk->stats;
+	map = bpf_object__find_map_by_name(xdp_program__bpf_obj(p), "xsks_map");
+	*map_fd = bpf_map__fd(map);
+	return p;
+}
+
+/* Frames of the --tx-only template, see tx_only_fill_umem() */
+static uint8_t tx_src_mac[ETH_ALEN];
+static uint8_t tx_dst_mac[ETH_ALEN];
+
+static struct xsk_umem_info *create_umem(uint64_t size)
+{
+	struct xsk_umem_info *umem;
+	void *buffer;
+	int err;
+
+	buffer = alloc_umem_area(&size, cfg.ifname, cfg.xsk_hugepages);
+	if (!buffer)
+		return NULL;
+
+	umem = configure_xsk_umem(buffer, size, cfg.xsk_frame_size);
+	if (!umem) {
+		err = errno;
+		munmap(buffer, size);
+		errno = err;
+		return NULL;
+	}
+	if (verbose)
+		printf("UMEM: %u frames of %u bytes\n",
+		       umem->pool.nr_frames, umem->frame_size);
+
+	if (cfg.xsk_tx_only)
+		tx_only_fill_umem(umem, tx_src_mac, tx_dst_mac);
+	return umem;
+}
+
+static void destroy_umem(struct xsk_umem_info *umem)
+{
+	xsk_umem__delete(umem->umem);
+	munmap(umem->buffer, umem->size);
+	pthread_mutex_destroy(&umem->pool.lock);
+	free(umem->pool.addrs);
+	free(umem);
+}
+
+/* Close a socket whose worker has stopped, a UMEM goes with its last user */
+static void xsk_destroy_socket(struct xsk_socket_info *xsk)
+{
+	struct xsk_umem_info *umem = xsk->umem;
+
+	if (cfg.xsk_af_packet) {
+		pkt_close_socket(xsk);
+		return;
+	}
+
+	xsk_socket__delete(xsk->xsk);
+	if (--umem->nr_users == 0)
+		destroy_umem(umem);
+	free(xsk);
+}
+
+/* Handle what is still on the RX rings of the given sockets and reap all
+ * their TX completions. The kernel must have stopped steering packets to
+ * them, but ones already on their way through XDP_REDIRECT can still land
+ * for a little while. Runs with the workers of the sockets stopped, the
+ * handler is then called from this thread.
+ */
+static void xsk_drain(struct xsk_socket_info **list, int n)
+{
+	uint64_t now, quiet, deadline;
+	struct xsk_socket_info *xsk;
+	bool busy;
+	int i;
+
+	now = gettime();
+	quiet = now + DRAIN_QUIET_MS * 1000000ULL;
+	deadline = now + DRAIN_TIMEOUT_MS * 1000000ULL;
+	for (;;) {
+		busy = false;
+		for (i = 0; i < n; i++) {
+			xsk = list[i];
+			if (!cfg.xsk_tx_only && xsk_cons_nb_avail(&xsk->rx, 1)) {
+				handle_receive_packets(xsk);
+				busy = true;
+			} else if (xsk->outstanding_tx) {
+				complete_tx(xsk);
+				busy = true;
+			}
+		}
+		now = gettime();
+		if ((!busy && now >= quiet) || now >= deadline)
+			break;
+	}
+
+	for (i = 0; i < n; i++)
+		if (list[i]->outstanding_tx)
+			fprintf(stderr, "WARN: %s queue %d: %u TX frames not "
+				"completed after %d ms\n", list[i]->ifname,
+				list[i]->queue_id, list[i]->outstanding_tx,
+				DRAIN_TIMEOUT_MS);
+}
+
+/* Check that every frame of a UMEM is somewhere we know of, once its
+ * sockets are drained. Returns the number of missing frames.
+ */
+static uint32_t umem_check_frames(struct xsk_umem_info *umem)
+{
+	struct xsk_socket_info *xsk;
+	uint32_t found, in_fill = 0, in_rx = 0, in_tx = 0, cached = 0;
+	bool zero_copy = false;
+	int i;
+
+	for (i = 0; i < num_xsks; i++) {
+		xsk = xsks[i];
+		if (xsk->umem != umem)
+			continue;
+
+		cached += xsk->frame_cache.nr;
+		in_fill += *xsk->fq.producer -
+			   __atomic_load_n(xsk->fq.consumer, __ATOMIC_ACQUIRE);
+		if (!cfg.xsk_tx_only)
+			in_rx += xsk_cons_nb_avail(&xsk->rx, xsk->rx.size);
+		in_tx += xsk->outstanding_tx;
+		zero_copy |= xsk->zero_copy;
+	}
+
+	found = umem->pool.nr_free + cached + in_fill + in_rx + in_tx;
+	if (found == umem->pool.nr_frames) {
+		if (verbose)
+			printf("UMEM: all %u frames accounted for\n",
+			       umem->pool.nr_frames);
+		return 0;
+	}
+
+	/* A zero-copy driver keeps frames it took from the fill ring in its
+	 * hardware ring, those only come back through RX */
+	fprintf(stderr, "WARN: UMEM: %u of %u frames missing (%u free, %u cached, "
+		"%u fill, %u RX, %u TX)%s\n", umem->pool.nr_frames - found,
+		umem->pool.nr_frames, umem->pool.nr_free, cached, in_fill,
+		in_rx, in_tx, zero_copy ? ", some may be held by the driver" : "");
+	return umem->pool.nr_frames - found;
+}
+
+/* Take a socket out of service without losing what is in flight: stop its
+ * worker, stop the kernel from steering packets to it, then drain it.
+ * Called with the workers parked.
+ */
+static void xsk_drain_socket(struct xsk_socket_info *xsk)
+{
+	int queue_id = xsk->queue_id;
+
+	pthread_mutex_lock(&park_lock);
+	__atomic_store_n(&xsk->stop, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+	pthread_join(xsk->thread, NULL);
+
+	/* With the default program libxdp only removes the entry in
+	 * xsk_socket__delete(), so what arrives in between is lost */
+	if (custom_xsk && !cfg.xsk_tx_only)
+		bpf_map_delete_elem(xsk_map_fd, &queue_id);
+
+	xsk_drain(&xsk, 1);
+}
+
+static struct xsk_socket_info *find_queue(int queue_id, int *idx)
+{
+	int i;
+
+	for (i = 0; i < num_xsks; i++) {
+		if (xsks[i]->ifindex == cfg.ifindex &&
+		    xsks[i]->queue_id == queue_id) {
+			*idx = i;
+			return xsks[i];
+		}
 	}
 	return NULL;
 }
 
-static void exit_application(int signal)
+static const char *ctrl_add_queue(int queue_id)
 {
-	int err;
+	struct xsk_umem_info *umem;
+	struct xsk_socket_info *xsk;
+	int idx, err;
 
-	cfg.unload_all = true;
-	err = do_unload(&cfg);
+	if (cfg.xsk_shared_umem)
+		return "not possible with a shared UMEM";
+	if (queue_id < 0 || queue_id >= MAX_XSKS || num_xsks == MAX_XSKS)
+		return "queue out of range";
+	if (find_queue(queue_id, &idx))
+		return "queue already has a socket";
+
+	umem = create_umem((uint64_t)cfg.xsk_frames * cfg.xsk_frame_size);
+	if (!umem)
+		return strerror(errno);
+
+	xsk = xsk_configure_socket(&cfg, umem, cfg.ifname, cfg.ifindex,
+				   queue_id, xsk_map_fd);
+	if (!xsk) {
+		err = errno;
+		destroy_umem(umem);
+		return strerror(err);
+	}
+	xsk->prev_stats.timestamp = gettime();
+
+	if (park_workers()) {
+		xsk_destroy_socket(xsk);
+		return "exiting";
+	}
+
+	pthread_mutex_lock(&xsks_lock);
+	idx = num_xsks;
+	xsks[num_xsks++] = xsk;
+	update_handler_ctx();
+	pthread_mutex_unlock(&xsks_lock);
+
+	err = start_worker(xsk, idx);
 	if (err) {
-		fprintf(stderr, "Couldn't detach XDP program on iface '%s' : (%d)\n",
-			cfg.ifname, err);
+		pthread_mutex_lock(&xsks_lock);
+		num_xsks--;
+		update_handler_ctx();
+		pthread_mutex_unlock(&xsks_lock);
+	}
+	unpark_workers();
+
+	if (err) {
+		xsk_destroy_socket(xsk);
+		return strerror(-err);
+	}
+	return NULL;
+}
+
+static const char *ctrl_del_queue(int queue_id)
+{
+	struct xsk_socket_info *xsk;
+	int idx;
+
+	if (cfg.xsk_shared_umem)
+		return "not possible with a shared UMEM";
+	xsk = find_queue(queue_id, &idx);
+	if (!xsk)
+		return "no socket on that queue";
+
+	if (park_workers())
+		return "exiting";
+
+	xsk_drain_socket(xsk);
+	umem_check_frames(xsk->umem);
+
+	pthread_mutex_lock(&xsks_lock);
+	stats_sum(&retired_stats, &xsk->stats);
+	memmove(&xsks[idx], &xsks[idx + 1],
+		(num_xsks - idx - 1) * sizeof(xsks[0]));
+	num_xsks--;
+	update_handler_ctx();
+	pthread_mutex_unlock(&xsks_lock);
+
+	unpark_workers();
+
+	/* The socket had a UMEM of its own, which takes all its frames
+	 * along, also those the driver still held */
+	xsk_destroy_socket(xsk);
+	return NULL;
+}
+
+/* Ring sizes and frames for the sockets added from now on. To resize the
+ * rings of a queue, remove it and add it back.
+ */
+static const char *ctrl_set(const char *name, const char *value)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(value, &end, 0);
+	if (*end || !n || n > UINT32_MAX)
+		return "invalid value";
+
+	if (!strcmp(name, "frames")) {
+		if (n < cfg.xsk_fill_size)
+			return "fewer frames than the fill ring size";
+		cfg.xsk_frames = n;
+		return NULL;
+	}
+
+	if (!is_pow2(n))
+		return "ring sizes must be a power of 2";
+
+	if (!strcmp(name, "rx-ring")) {
+		cfg.xsk_rx_size = n;
+	} else if (!strcmp(name, "tx-ring")) {
+		cfg.xsk_tx_size = n;
+	} else if (!strcmp(name, "fill-ring")) {
+		if (n > cfg.xsk_frames)
+			return "fill ring larger than the frames";
+		cfg.xsk_fill_size = n;
+	} else if (!strcmp(name, "comp-ring")) {
+		cfg.xsk_comp_size = n;
+	} else {
+		return "unknown setting";
+	}
+	return NULL;
+}
+
+static const char *ctrl_swap_prog(const char *file, const char *progname)
+{
+	struct xdp_program *p;
+	int map_fd;
+
+	if (!custom_xsk)
+		return "no --filename program to replace";
+
+	p = swap_custom_program(prog, cfg.ifindex, cfg.ifname, file,
+				progname, &map_fd);
+	if (!p)
+		return "can't attach the new program, see the log";
+	prog = p;
+	xsk_map_fd = map_fd;
+
+	strncpy(cfg.filename, file, sizeof(cfg.filename) - 1);
+	strncpy(cfg.progname, progname ? progname : "",
+		sizeof(cfg.progname) - 1);
+
+	if (redirect_prog) {
+		p = swap_custom_program(redirect_prog, cfg.redirect_ifindex,
+					cfg.redirect_ifname, file, progname,
+					&map_fd);
+		if (!p)
+			return "new program only attached to --dev, see the log";
+		redirect_prog = p;
+		redirect_xsk_map_fd = map_fd;
+	}
+	return NULL;
+}
+
+static const char *ctrl_rules(const char *file)
+{
+	if (!custom_xsk)
+		return "no --filename program to load rules into";
+	if (load_rules(file, prog) ||
+	    (redirect_prog && load_rules(file, redirect_prog)))
+		return "can't load rules, see the log";
+	return NULL;
+}
+
+/* The queue id argument of add-queue and del-queue */
+static const char *ctrl_queue_id(const char *value, int *queue_id)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(value, &end, 0);
+	if (end == value || *end || n > INT_MAX)
+		return "invalid queue";
+	*queue_id = n;
+	return NULL;
+}
+
+/* Run one command line, the reply goes to out */
+static void ctrl_command(char *line, char *out, size_t size)
+{
+	char *argv[4], *saveptr, *c;
+	const char *err = NULL;
+	size_t len = 0;
+	int i, queue_id, argc = 0;
+
+	for (c = strtok_r(line, " \t\r\n", &saveptr); c && argc < 4;
+	     c = strtok_r(NULL, " \t\r\n", &saveptr))
+		argv[argc++] = c;
+
+	if (!argc) {
+		err = "empty command";
+	} else if (!strcmp(argv[0], "list") && argc == 1) {
+		pthread_mutex_lock(&xsks_lock);
+		for (i = 0; i < num_xsks && len < size; i++)
+			len += snprintf(out + len, size - len,
+					"%s queue %d %s cpu %d\n",
+					xsks[i]->ifname, xsks[i]->queue_id,
+					xsks[i]->zero_copy ? "zero-copy" : "copy",
+					xsks[i]->cpu);
+		pthread_mutex_unlock(&xsks_lock);
+	} else if (!strcmp(argv[0], "add-queue") && argc == 2) {
+		err = ctrl_queue_id(argv[1], &queue_id);
+		if (!err)
+			err = ctrl_add_queue(queue_id);
+	} else if (!strcmp(argv[0], "del-queue") && argc == 2) {
+		err = ctrl_queue_id(argv[1], &queue_id);
+		if (!err)
+			err = ctrl_del_queue(queue_id);
+	} else if (!strcmp(argv[0], "set") && argc == 3) {
+		err = ctrl_set(argv[1], argv[2]);
+	} else if (!strcmp(argv[0], "swap-prog") && (argc == 2 || argc == 3)) {
+		err = ctrl_swap_prog(argv[1], argc == 3 ? argv[2] : NULL);
+	} else if (!strcmp(argv[0], "rules") && argc == 2) {
+		err = ctrl_rules(argv[1]);
+	} else {
+		err = "unknown command";
+	}
+
+	if (len >= size)
+		len = 0;
+	if (err)
+		snprintf(out + len, size - len, "ERR %s\n", err);
+	else
+		snprintf(out + len, size - len, "OK\n");
+
+	if (verbose)
+		printf("Control: %s%s%s\n", argc ? argv[0] : "",
+		       err ? ": " : "", err ? err : "");
+}
+
+/* Run the commands of a client, one per line. Only complete lines count: a
+ * line that stalls for the receive timeout is dropped, as is one too long
+ * for a command.
+ */
+static void ctrl_serve(int fd)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	char line[1024], reply[4096], *nl;
+	size_t len = 0, n;
+	bool skip = false;
+	ssize_t ret;
+
+	/* Don't let an idle client keep us from exiting */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (!global_exit) {
+		ret = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Whatever follows belongs to the stalled line */
+			skip = skip || len;
+			len = 0;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+
+		while ((nl = memchr(line, '\n', len))) {
+			*nl = '\0';
+			if (!skip) {
+				ctrl_command(line, reply, sizeof(reply));
+				if (send(fd, reply, strlen(reply),
+					 MSG_NOSIGNAL) < 0)
+					goto out;
+			}
+			skip = false;
+			n = nl + 1 - line;
+			len -= n;
+			memmove(line, nl + 1, len);
+		}
+
+		if (len == sizeof(line) - 1 && !skip) {
+			static const char err[] = "ERR line too long\n";
+
+			if (send(fd, err, sizeof(err) - 1, MSG_NOSIGNAL) < 0)
+				goto out;
+			skip = true;
+		}
+		if (skip)
+			len = 0;
+	}
+out:
+	close(fd);
+}
+
+/* Reconfiguration commands, one client at a time, see ctrl_command() */
+static void *ctrl_poll(void *arg)
+{
+	int fd, listen_fd = *(int *)arg;
+	struct pollfd pfd = {
+		.fd = listen_fd,
+		.events = POLLIN,
+	};
+
+	while (!global_exit) {
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd >= 0)
+			ctrl_serve(fd);
 	}
+	return NULL;
+}
 
-	signal = signal;
-	global_exit = true;
+static int ctrl_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd, err;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path); /* Left over from an earlier run */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 4) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	return fd;
 }
 
 int main(int argc, char **argv)
 {
 	int ret;
-	void *packet_buffer;
 	uint64_t packet_buffer_size;
-	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts);
-	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
 	struct rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
-	struct xsk_umem_info *umem;
+	struct xsk_umem_info *umem = NULL;
 	struct xsk_socket_info *xsk_socket;
-	pthread_t stats_poll_thread;
+	pthread_t stats_poll_thread, ctrl_poll_thread;
+	int i, d, queue_id, nr_devs, ctrl_fd = -1;
+	uint8_t fwd_mac[ETH_ALEN], fwd_redirect_mac[ETH_ALEN];
+	sigset_t exit_sigs, wait_sigs;
+	struct sigaction sigact;
 	int err;
-	char errmsg[1024];
 
-	/* Global shutdown handler */
-	signal(SIGINT, exit_application);
+	/* Global shutdown handler. The signals stay blocked, also in all
+	 * threads created from here, until main() waits for them below. */
+	memset(&sigact, 0, sizeof(sigact));
+	sigact.sa_handler = exit_application;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+	sigemptyset(&exit_sigs);
+	sigaddset(&exit_sigs, SIGINT);
+	sigaddset(&exit_sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &exit_sigs, &wait_sigs);
 
 	/* Cmdline options can change progname */
 	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
@@ -538,46 +3122,103 @@ int main(int argc, char **argv)
 		return EXIT_FAIL_OPTION;
 	}
 
-	/* Load custom program if configured */
-	if (cfg.filename[0] != 0) {
-		struct bpf_map *map;
+	/* The XSKMAP is indexed by queue id */
+	if (cfg.xsk_if_queue < 0 ||
+	    cfg.xsk_if_queue + cfg.xsk_queue_count > MAX_XSKS) {
+		fprintf(stderr, "ERROR: Queues %d-%d out of range (max %d)\n",
+			cfg.xsk_if_queue,
+			cfg.xsk_if_queue + cfg.xsk_queue_count - 1, MAX_XSKS - 1);
+		return EXIT_FAIL_OPTION;
+	}
 
-		custom_xsk = true;
-		xdp_opts.open_filename = cfg.filename;
-		xdp_opts.prog_name = cfg.progname;
-		xdp_opts.opts = &opts;
+	/* Forwarding mode: a socket on each queue of both devices, all on one
+	 * UMEM so frames move from RX to TX ring without being copied */
+	nr_devs = 1;
+	if (fwd_mode()) {
+		nr_devs = 2;
+		cfg.xsk_shared_umem = true;
+
+		if (cfg.xsk_queue_count * nr_devs > MAX_XSKS) {
+			fprintf(stderr, "ERROR: At most %d queues in forwarding mode\n",
+				MAX_XSKS / nr_devs);
+			return EXIT_FAIL_OPTION;
+		}
+		if (cfg.xsk_fwd_dst_mac[0] &&
+		    parse_mac(cfg.xsk_fwd_dst_mac, fwd_mac) < 0) {
+			fprintf(stderr, "ERROR: Can't parse MAC address %s\n",
+				cfg.xsk_fwd_dst_mac);
+			return EXIT_FAIL_OPTION;
+		}
+		if (cfg.xsk_fwd_redirect_dst_mac[0] &&
+		    parse_mac(cfg.xsk_fwd_redirect_dst_mac,
+			      fwd_redirect_mac) < 0) {
+			fprintf(stderr, "ERROR: Can't parse MAC address %s\n",
+				cfg.xsk_fwd_redirect_dst_mac);
+			return EXIT_FAIL_OPTION;
+		}
+	}
 
-		if (cfg.progname[0] != 0) {
-			xdp_opts.open_filename = cfg.filename;
-			xdp_opts.prog_name = cfg.progname;
-			xdp_opts.opts = &opts;
+	/* The kernel only redirects to the socket of another queue if it is
+	 * on the same UMEM as the socket of the RX queue */
+	if (cfg.xsk_flow_hash)
+		cfg.xsk_shared_umem = true;
 
-			prog = xdp_program__create(&xdp_opts);
-		} else {
-			prog = xdp_program__open_file(cfg.filename,
-						  NULL, &opts);
-		}
-		err = libxdp_get_error(prog);
-		if (err) {
-			libxdp_strerror(err, errmsg, sizeof(errmsg));
-			fprintf(stderr, "ERR: loading program: %s\n", errmsg);
-			return err;
+	tx_csum_offload = cfg.xsk_tx_csum_offload && !cfg.xsk_af_packet;
+
+	/* The kernel doesn't busy-poll AF_PACKET sockets */
+	if (cfg.xsk_af_packet &&
+	    (cfg.filename[0] || cfg.xsk_rules[0] || cfg.xsk_tx_only ||
+	     cfg.xsk_ctrl_sock[0] || cfg.xsk_bind_flags & XDP_USE_SG ||
+	     cfg.xsk_busy_poll)) {
+		fprintf(stderr, "ERROR: --af-packet can't be combined with --filename, "
+			"--rules, --tx-only, --multi-buffer, --busy-poll or --ctrl-sock\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	/* Load custom program if configured, one instance per device since
+	 * each needs its own xsks_map */
+	if (cfg.filename[0] != 0) {
+		custom_xsk = true;
+		prog = load_custom_program(cfg.ifindex, cfg.ifname, &xsk_map_fd);
+		if (!prog)
+			exit(EXIT_FAILURE);
+		if (fwd_mode()) {
+			redirect_prog = load_custom_program(cfg.redirect_ifindex,
+							    cfg.redirect_ifname,
+							    &redirect_xsk_map_fd);
+			if (!redirect_prog)
+				exit(EXIT_FAILURE);
 		}
 
-		err = xdp_program__attach(prog, cfg.ifindex, cfg.attach_mode, 0);
+		if (cfg.xsk_rules[0] &&
+		    (load_rules(cfg.xsk_rules, prog) ||
+		     (redirect_prog && load_rules(cfg.xsk_rules, redirect_prog))))
+			exit(EXIT_FAILURE);
+	} else if (cfg.xsk_rules[0] || cfg.xsk_flow_hash ||
+		   (cfg.xsk_rx_metadata && !cfg.xsk_af_packet)) {
+		fprintf(stderr, "ERROR: --rules, --rx-metadata and --flow-hash need a --filename program\n");
+		exit(EXIT_FAIL_OPTION);
+	}
+
+	handler = load_handler(cfg.xsk_handler);
+	if (!handler)
+		exit(EXIT_FAIL_OPTION);
+
+	if (handler->init) {
+		err = handler->init(cfg.xsk_handler_args[0] ?
+				    cfg.xsk_handler_args : NULL, &handler_priv);
 		if (err) {
-			libxdp_strerror(err, errmsg, sizeof(errmsg));
-			fprintf(stderr, "Couldn't attach XDP program on iface '%s' : %s (%d)\n",
-				cfg.ifname, errmsg, err);
-			return err;
+			fprintf(stderr, "ERROR: Handler %s init failed \"%s\"\n",
+				handler->name, strerror(-err));
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		/* We also need to load the xsks_map */
-		map = bpf_object__find_map_by_name(xdp_program__bpf_obj(prog), "xsks_map");
-		xsk_map_fd = bpf_map__fd(map);
-		if (xsk_map_fd < 0) {
-			fprintf(stderr, "ERROR: no xsks map found: %s\n",
-				strerror(xsk_map_fd));
+	if (cfg.xsk_pass_dev[0]) {
+		pass_fd = open_pass_dev(cfg.xsk_pass_dev);
+		if (pass_fd < 0) {
+			fprintf(stderr, "ERROR: Can't create TAP device %s \"%s\"\n",
+				cfg.xsk_pass_dev, strerror(-pass_fd));
 			exit(EXIT_FAILURE);
 		}
 	}
@@ -599,36 +3240,135 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	/* Allocate memory for NUM_FRAMES of the default XDP frame size */
-	packet_buffer_size = NUM_FRAMES * FRAME_SIZE;
-	if (posix_memalign(&packet_buffer,
-			   getpagesize(), /* PAGE_SIZE aligned */
-			   packet_buffer_size)) {
-		fprintf(stderr, "ERROR: Can't allocate buffer memory \"%s\"\n",
-			strerror(errno));
-		exit(EXIT_FAILURE);
+	if (!is_pow2(cfg.xsk_rx_size) || !is_pow2(cfg.xsk_tx_size) ||
+	    !is_pow2(cfg.xsk_fill_size) || !is_pow2(cfg.xsk_comp_size)) {
+		fprintf(stderr, "ERROR: Ring sizes must be a power of 2\n");
+		exit(EXIT_FAIL_OPTION);
 	}
 
-	/* Initialize shared packet_buffer for umem usage */
-	umem = configure_xsk_umem(packet_buffer, packet_buffer_size);
-	if (umem == NULL) {
-		fprintf(stderr, "ERROR: Can't create umem \"%s\"\n",
-			strerror(errno));
-		exit(EXIT_FAILURE);
+	if (!cfg.xsk_rx_batch || cfg.xsk_rx_batch > MAX_BATCH_SIZE ||
+	    !cfg.xsk_tx_batch || cfg.xsk_tx_batch > MAX_BATCH_SIZE) {
+		fprintf(stderr, "ERROR: Batch sizes must be 1-%d\n",
+			MAX_BATCH_SIZE);
+		exit(EXIT_FAIL_OPTION);
 	}
 
-	/* Open and configure the AF_XDP (xsk) socket */
-	xsk_socket = xsk_configure_socket(&cfg, umem);
-	if (xsk_socket == NULL) {
-		fprintf(stderr, "ERROR: Can't setup AF_XDP socket \"%s\"\n",
-			strerror(errno));
-		exit(EXIT_FAILURE);
+	if (cfg.xsk_tx_only &&
+	    (fwd_mode() || cfg.xsk_bind_flags & XDP_USE_SG ||
+	     cfg.xsk_tx_pkt_size < ETH_ZLEN ||
+	     cfg.xsk_tx_pkt_size > cfg.xsk_frame_size ||
+	     !cfg.xsk_tx_flows || cfg.xsk_tx_flows > TX_MAX_FLOWS)) {
+		fprintf(stderr, "ERROR: --tx-only needs --tx-size %d-%u, --tx-flows 1-%d "
+			"and no --redirect-dev or --multi-buffer\n",
+			ETH_ZLEN, cfg.xsk_frame_size, TX_MAX_FLOWS);
+		exit(EXIT_FAIL_OPTION);
+	}
+
+	/* A whole multi-buffer packet must fit in one RX and one TX batch */
+	if (cfg.xsk_bind_flags & XDP_USE_SG &&
+	    (cfg.xsk_rx_batch < MAX_FRAGS || cfg.xsk_tx_batch < MAX_FRAGS)) {
+		fprintf(stderr, "ERROR: --multi-buffer needs batch sizes of at least %d\n",
+			MAX_FRAGS);
+		exit(EXIT_FAIL_OPTION);
+	}
+
+	if (cfg.xsk_frames < cfg.xsk_fill_size) {
+		fprintf(stderr, "ERROR: --frames must be at least the fill ring size (%u)\n",
+			cfg.xsk_fill_size);
+		exit(EXIT_FAIL_OPTION);
 	}
 
+	if (cfg.xsk_tx_only) {
+		memset(tx_dst_mac, 0xff, ETH_ALEN);
+		if (cfg.dest_mac[0] && parse_mac(cfg.dest_mac, tx_dst_mac) < 0) {
+			fprintf(stderr, "ERROR: Can't parse MAC address %s\n",
+				cfg.dest_mac);
+			exit(EXIT_FAIL_OPTION);
+		}
+		err = get_ifname_mac(cfg.ifname, tx_src_mac);
+		if (err) {
+			fprintf(stderr, "ERROR: Can't get MAC address of %s \"%s\"\n",
+				cfg.ifname, strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < cfg.xsk_queue_count * nr_devs; i++) {
+		queue_id = cfg.xsk_if_queue + i / nr_devs;
+		d = i % nr_devs;
+
+		if (!cfg.xsk_af_packet && (!umem || !cfg.xsk_shared_umem)) {
+			/* Allocate memory for xsk_frames frames per socket,
+			 * either as one shared UMEM or one UMEM per socket */
+			packet_buffer_size = (uint64_t)cfg.xsk_frames *
+					     cfg.xsk_frame_size;
+			if (cfg.xsk_shared_umem)
+				packet_buffer_size *= cfg.xsk_queue_count *
+						      nr_devs;
+
+			umem = create_umem(packet_buffer_size);
+			if (umem == NULL) {
+				fprintf(stderr, "ERROR: Can't create umem \"%s\"\n",
+					strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/* Open and configure the AF_XDP (xsk) socket, or the AF_PACKET
+		 * socket in one fanout group per device */
+		if (cfg.xsk_af_packet)
+			xsk_socket = pkt_configure_socket(
+				d ? cfg.redirect_ifname : cfg.ifname,
+				d ? cfg.redirect_ifindex : cfg.ifindex, queue_id,
+				cfg.xsk_queue_count > 1 ?
+				(getpid() + d) & 0xffff : -1);
+		else if (d == 0)
+			xsk_socket = xsk_configure_socket(&cfg, umem, cfg.ifname,
+							  cfg.ifindex, queue_id,
+							  xsk_map_fd);
+		else
+			xsk_socket = xsk_configure_socket(&cfg, umem,
+							  cfg.redirect_ifname,
+							  cfg.redirect_ifindex,
+							  queue_id,
+							  redirect_xsk_map_fd);
+		if (xsk_socket == NULL) {
+			fprintf(stderr, "ERROR: Can't setup %s socket on %s queue %d \"%s\"\n",
+				cfg.xsk_af_packet ? "AF_PACKET" : "AF_XDP",
+				d ? cfg.redirect_ifname : cfg.ifname, queue_id,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		xsks[num_xsks++] = xsk_socket;
+
+		if (fwd_mode()) {
+			err = get_ifname_mac(xsk_socket->ifname,
+					     xsk_socket->if_mac);
+			if (err) {
+				fprintf(stderr, "ERROR: Can't get MAC address of %s \"%s\"\n",
+					xsk_socket->ifname, strerror(-err));
+				exit(EXIT_FAILURE);
+			}
+			if (d == 0 && cfg.xsk_fwd_dst_mac[0]) {
+				memcpy(xsk_socket->next_hop_mac, fwd_mac, ETH_ALEN);
+				xsk_socket->has_next_hop = true;
+			} else if (d == 1 && cfg.xsk_fwd_redirect_dst_mac[0]) {
+				memcpy(xsk_socket->next_hop_mac,
+				       fwd_redirect_mac, ETH_ALEN);
+				xsk_socket->has_next_hop = true;
+			}
+		}
+	}
+
+	if (cfg.xsk_flow_hash &&
+	    (load_rss_table(prog, cfg.ifindex) ||
+	     (redirect_prog &&
+	      load_rss_table(redirect_prog, cfg.redirect_ifindex))))
+		exit(EXIT_FAILURE);
+
 	/* Start thread to do statistics display */
 	if (verbose) {
-		ret = pthread_create(&stats_poll_thread, NULL, stats_poll,
-				     xsk_socket);
+		ret = pthread_create(&stats_poll_thread, NULL, stats_poll, NULL);
 		if (ret) {
 			fprintf(stderr, "ERROR: Failed creating statistics thread "
 				"\"%s\"\n", strerror(errno));
@@ -636,12 +3376,73 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* Receive and count packets than drop them */
-	rx_and_process(&cfg, xsk_socket);
+	if (cfg.xsk_ctrl_sock[0]) {
+		ctrl_fd = ctrl_open(cfg.xsk_ctrl_sock);
+		if (ctrl_fd < 0) {
+			fprintf(stderr, "ERROR: Can't open control socket %s \"%s\"\n",
+				cfg.xsk_ctrl_sock, strerror(-ctrl_fd));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Receive and count packets than drop them, one worker per queue */
+	if (start_workers())
+		exit(EXIT_FAILURE);
 
-	/* Cleanup */
-	xsk_socket__delete(xsk_socket->xsk);
-	xsk_umem__delete(umem->umem);
+	if (ctrl_fd >= 0) {
+		ret = pthread_create(&ctrl_poll_thread, NULL, ctrl_poll, &ctrl_fd);
+		if (ret) {
+			fprintf(stderr, "ERROR: Failed creating control thread "
+				"\"%s\"\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Wait for SIGINT or SIGTERM, with no window to miss it in */
+	while (!global_exit)
+		sigsuspend(&wait_sigs);
+
+	/* Let a second one through, to give up on a shutdown that hangs */
+	pthread_sigmask(SIG_SETMASK, &wait_sigs, NULL);
+
+	/* All threads look at global_exit at least once a second. The control
+	 * thread adds and removes workers, so it goes first. */
+	if (ctrl_fd >= 0) {
+		pthread_join(ctrl_poll_thread, NULL);
+		close(ctrl_fd);
+		unlink(cfg.xsk_ctrl_sock);
+	}
+	for (i = 0; i < num_xsks; i++)
+		pthread_join(xsks[i]->thread, NULL);
+	if (verbose)
+		pthread_join(stats_poll_thread, NULL);
+
+	/* No more packets for the sockets, then empty their rings */
+	if (!cfg.xsk_af_packet) {
+		/* A TX-only run without --filename attached nothing, and must
+		 * leave whatever program the device has alone */
+		if (custom_xsk || !cfg.xsk_tx_only)
+			unload_programs();
+		xsk_drain(xsks, num_xsks);
+	}
+
+	if (handler->fini)
+		handler->fini(handler_priv);
+	if (handler_dl)
+		dlclose(handler_dl);
+	if (pass_fd >= 0)
+		close(pass_fd);
+
+	/* Cleanup, a shared UMEM goes away with its last socket */
+	for (i = 0; i < num_xsks && !cfg.xsk_af_packet; i++) {
+		umem = xsks[i]->umem;
+		for (d = 0; d < i && xsks[d]->umem != umem; d++)
+			;
+		if (d == i)
+			umem_check_frames(umem);
+	}
+	for (i = 0; i < num_xsks; i++)
+		xsk_destroy_socket(xsks[i]);
 
 	return EXIT_OK;
 }
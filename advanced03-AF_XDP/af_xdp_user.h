@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Internals of af_xdp_user shared by its compilation units: the socket
+ * state of a worker, its stats, and the engine calls the AF_PACKET backend
+ * (af_xdp_afpacket.c) makes. Not part of the handler API.
+ */
+#ifndef __AF_XDP_USER_H
+#define __AF_XDP_USER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <xdp/xsk.h>
+#include <linux/if_ether.h>
+
+#include "../common/common_defines.h"
+#include "af_xdp_handler.h"
+
+#define RX_BATCH_SIZE      64  /* Default for both RX and TX */
+#define MAX_BATCH_SIZE     256
+#define FRAME_CACHE_SIZE   (4 * RX_BATCH_SIZE)
+#define MAX_XSKS           64 /* Same as max_entries of xsks_map */
+#define MAX_FRAGS          18 /* MAX_SKB_FRAGS + 1, buffers per SG packet */
+#define CACHE_LINE_SIZE    64
+
+/* RX batch sizes are counted in log2 buckets: 1, 2-3, 4-7 .. 256 packets */
+#define BATCH_HIST_BUCKETS 9
+
+/* Log-linear (HDR style) latency histogram in nanoseconds: values below
+ * LAT_HIST_SUB are exact, above that every power of 2 is split into
+ * LAT_HIST_SUB buckets, which keeps the error below 1/LAT_HIST_SUB (6%)
+ * up to 2^LAT_HIST_MAX_BITS ns (1s). Larger values go in the last bucket.
+ */
+#define LAT_HIST_SUB_BITS  4
+#define LAT_HIST_SUB       (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_BITS  30
+#define LAT_HIST_BUCKETS   ((LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS + 1) * \
+			    LAT_HIST_SUB)
+
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+
+/* Per-socket (and thus per-thread) cache in front of the global pool, so
+ * the pool lock is only taken once per FRAME_CACHE_SIZE/2 frames.
+ */
+struct xsk_frame_cache {
+	uint64_t addrs[FRAME_CACHE_SIZE];
+	uint32_t nr;
+};
+
+/* Each worker only writes its own stats_record, on cache lines of its own,
+ * and the stats thread reads them. See stat_add() and stat_read().
+ */
+struct stats_record {
+	uint64_t timestamp;
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t fill_empty;	/* Kernel had consumed the whole fill ring */
+	uint64_t tx_full_drops;	/* Packets dropped for lack of TX ring slots */
+	uint64_t wakeups;	/* poll(), sendto() and recvfrom() calls */
+	uint64_t ring_drops;	/* AF_PACKET: packets lost to a full RX ring */
+	uint64_t rx_batches[BATCH_HIST_BUCKETS];
+	uint64_t latency[LAT_HIST_BUCKETS]; /* RX to TX submit, in ns */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+struct xsk_socket_info {
+	struct xsk_ring_cons rx;
+	struct xsk_ring_prod tx;
+	struct xsk_ring_prod fq;
+	struct xsk_ring_cons cq;
+	struct xsk_umem_info *umem;
+	struct xsk_socket *xsk;
+
+	struct xsk_frame_cache frame_cache;
+
+	/* Other workers may forward frames into our TX ring */
+	pthread_spinlock_t tx_lock;
+	uint32_t outstanding_tx;
+
+	struct xsk_handler_ctx handler_ctx;
+
+	bool zero_copy;		/* Effective mode, from XDP_OPTIONS */
+
+	uint32_t tx_flow;	/* Next flow to send, with --tx-only */
+
+	struct stats_record stats;
+	struct stats_record prev_stats; /* Only used by the stats thread */
+
+	/* Device the socket is bound to. In forwarding mode, frames sent out
+	 * of it get if_mac as source and, if set, next_hop_mac as destination */
+	const char *ifname;
+	int ifindex;
+	uint8_t if_mac[ETH_ALEN];
+	uint8_t next_hop_mac[ETH_ALEN];
+	bool has_next_hop;
+
+	/* Worker thread servicing this socket */
+	int queue_id;
+	int cpu;
+	pthread_t thread;
+	bool stop;		/* Set to end the worker, e.g. del-queue */
+
+	/* AF_PACKET backend, instead of the rings and UMEM above */
+	int pkt_fd;
+	uint8_t *pkt_ring;
+	uint32_t pkt_block_nr;
+	uint32_t pkt_block;	/* Next block to look at */
+};
+
+
+extern struct config cfg;
+
+/* One socket (and worker thread) per configured RX queue, see
+ * af_xdp_user.c */
+extern struct xsk_socket_info *xsks[MAX_XSKS];
+extern int num_xsks;
+
+extern const struct xsk_handler *handler;
+extern int pass_fd; /* --pass-dev, -1 without */
+
+/* Counters have a single writer, the worker owning them. Relaxed atomic
+ * loads and stores keep the stats thread from seeing torn values, also for
+ * 64-bit counters on 32-bit CPUs, without a locked read-modify-write.
+ */
+static inline void stat_add(uint64_t *ctr, uint64_t val)
+{
+	__atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + val,
+			 __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_read(const uint64_t *ctr)
+{
+	return __atomic_load_n(ctr, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int batch_hist_index(unsigned int n)
+{
+	return 31 - __builtin_clz(n);
+}
+
+/* af_xdp_user.c */
+uint64_t gettime(void);
+bool worker_running(struct xsk_socket_info *xsk);
+void pass_packet(const struct xsk_pkt *pkt);
+void pkt_csum_complete(const struct xsk_pkt *pkt);
+void lat_record(struct xsk_socket_info *xsk, const uint64_t *t_rx,
+		unsigned int n);
+
+/* AF_PACKET backend (--af-packet), af_xdp_afpacket.c */
+struct xsk_socket_info *pkt_configure_socket(const char *ifname, int ifindex,
+					     int queue_id, int fanout_id);
+void pkt_close_socket(struct xsk_socket_info *xsk);
+void pkt_rx_and_process(struct xsk_socket_info *xsk);
+
+#endif /* __AF_XDP_USER_H */
@@ -0,0 +1,76 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+#define XSK_MAX_RULES 1024
+
+/* What af_xdp_kern.c does with a packet matching a steering rule. Packets
+ * not matching any rule are passed to the kernel stack.
+ */
+enum xsk_rule_action {
+	XSK_RULE_PASS = 0,
+	XSK_RULE_REDIRECT,	/* To the AF_XDP socket of the RX queue */
+	XSK_RULE_DROP,
+};
+
+/* Exact 5-tuple match. IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d),
+ * everything is in network byte order. Ports are 0 for other protocols than
+ * TCP and UDP.
+ */
+struct xsk_flow_key {
+	__u32 saddr[4];
+	__u32 daddr[4];
+	__u16 sport;
+	__u16 dport;
+	__u8 proto;
+	__u8 pad[3];
+};
+
+/* Wildcard match on IP protocol and destination port, with a dport of 0
+ * matching any port and a proto of 0 matching any IP packet.
+ */
+struct xsk_port_key {
+	__u16 dport;
+	__u8 proto;
+	__u8 pad;
+};
+
+/* Queues a rule can be limited to, one bit each in queue_mask */
+#define XSK_RULE_MAX_QUEUES 64
+
+struct xsk_rule {
+	__u32 action;		/* enum xsk_rule_action */
+	__u32 rule_id;		/* Line number in the rules file */
+	__u64 queue_mask;	/* RX queues the rule applies to, 0 = all */
+};
+
+/* Per-packet metadata, written by af_xdp_kern.c with bpf_xdp_adjust_meta()
+ * right in front of the packet data of redirected packets, so it ends up in
+ * the UMEM headroom of the frame. Its size must be a multiple of 4.
+ */
+struct xsk_meta {
+	__u64 rx_timestamp;	/* ns, NIC clock with XSK_META_HW_TIMESTAMP,
+				 * else CLOCK_MONOTONIC at XDP time */
+	__u32 rx_hash;		/* RSS hash with XSK_META_HW_HASH, else 0 */
+	__u32 rule_id;		/* Steering rule the packet matched */
+	__u32 flags;
+	__u32 pad;
+};
+
+/* Flow hash mode (af_xdp_user --flow-hash): redirected packets go to the
+ * socket of queues[hash % nr_queues] instead of that of their RX queue. All
+ * these sockets must be on one UMEM, see README.org.
+ */
+#define XSK_RSS_MAX_QUEUES 64
+
+struct xsk_rss_table {
+	__u32 nr_queues;	/* 0 = off */
+	__u32 queues[XSK_RSS_MAX_QUEUES];
+};
+
+#define XSK_META_HW_TIMESTAMP	(1 << 0)
+#define XSK_META_HW_HASH	(1 << 1)
+
+#endif /* __COMMON_KERN_USER_H */
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: (GPL-2.0-or-later OR BSD-2-clause) */
+/*
+ * This file contains functions that are used in the packetXX XDP programs to
+ * update the Internet checksum (RFC 1071) of a header after rewriting some of
+ * its fields, without summing the whole header or payload again. The functions
+ * are marked as __always_inline, and fully defined in this header file to be
+ * included in the BPF program.
+ *
+ * The updates follow RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m'), with the sums
+ * done in 32 bits and folded once at the end, which gets the end-around carry
+ * right and never turns a checksum into -0 by mistake. They work on the
+ * values as loaded from the packet, so no byte swapping is needed.
+ *
+ * The csum_replace*() helpers are for checksums over the header itself (IPv4
+ * header, ICMP). The l4_csum_replace*() helpers are for TCP and UDP, whose
+ * checksum also covers the pseudo header: use them for the ports, and for the
+ * IP addresses when those are rewritten. For UDP they keep a checksum of 0,
+ * meaning none (RFC 768), and turn a computed 0 into 0xffff.
+ *
+ * experiment02-csum-helpers tests them against full recomputation.
+ */
+
+#ifndef __CHECKSUM_HELPERS_H
+#define __CHECKSUM_HELPERS_H
+
+#include <linux/types.h>
+#include <linux/in.h>
+
+#include <bpf/bpf_helpers.h>
+
+/* Transmitted in place of a computed UDP checksum of 0 */
+#define CSUM_MANGLED_0 ((__sum16)0xffff)
+
+/* Fold a 32-bit partial sum, e.g. from bpf_csum_diff(), into the checksum
+ * field value, like the kernel's csum_fold()
+ */
+static __always_inline __sum16 csum_fold(__u32 csum)
+{
+	csum = (csum & 0xffff) + (csum >> 16);
+	csum = (csum & 0xffff) + (csum >> 16);
+	return (__sum16)~csum;
+}
+
+/* Add the 16-bit words of a 32-bit value to a partial sum */
+static __always_inline __u32 csum_add32(__u32 csum, __u32 val)
+{
+	return csum + (val & 0xffff) + (val >> 16);
+}
+
+/* Update *sum for a 16-bit field changing from 'from' to 'to' */
+static __always_inline void csum_replace2(__sum16 *sum, __be16 from, __be16 to)
+{
+	__u32 csum = (__u16)~*sum;
+
+	csum += (__u16)~from;
+	csum += (__u16)to;
+	*sum = csum_fold(csum);
+}
+
+/* Same, for a 32-bit field such as an IPv4 address */
+static __always_inline void csum_replace4(__sum16 *sum, __be32 from, __be32 to)
+{
+	__u32 csum = (__u16)~*sum;
+
+	csum = csum_add32(csum, ~from);
+	csum = csum_add32(csum, to);
+	*sum = csum_fold(csum);
+}
+
+/* Same, for an IPv6 address, from and to point at its 16 bytes */
+static __always_inline void csum_replace16(__sum16 *sum, const __be32 *from,
+					   const __be32 *to)
+{
+	__u32 csum = (__u16)~*sum;
+	int i;
+
+	#pragma unroll
+	for (i = 0; i < 4; i++) {
+		csum = csum_add32(csum, ~from[i]);
+		csum = csum_add32(csum, to[i]);
+	}
+	*sum = csum_fold(csum);
+}
+
+/* A UDP checksum of 0 is left as is, see above */
+static __always_inline int l4_csum_none(__sum16 *check, int ip_proto)
+{
+	return ip_proto == IPPROTO_UDP && !*check;
+}
+
+static __always_inline void l4_csum_mangle_0(__sum16 *check, int ip_proto)
+{
+	if (ip_proto == IPPROTO_UDP && !*check)
+		*check = CSUM_MANGLED_0;
+}
+
+/* Update the TCP or UDP (per ip_proto) checksum *check for a rewritten port,
+ * or other 16-bit field of the L4 header
+ */
+static __always_inline void l4_csum_replace2(__sum16 *check, int ip_proto,
+					     __be16 from, __be16 to)
+{
+	if (l4_csum_none(check, ip_proto))
+		return;
+	csum_replace2(check, from, to);
+	l4_csum_mangle_0(check, ip_proto);
+}
+
+/* Update it for an IPv4 address in the pseudo header, after a rewrite of the
+ * IP header (whose own checksum needs a csum_replace4() as well)
+ */
+static __always_inline void l4_csum_replace4(__sum16 *check, int ip_proto,
+					     __be32 from, __be32 to)
+{
+	if (l4_csum_none(check, ip_proto))
+		return;
+	csum_replace4(check, from, to);
+	l4_csum_mangle_0(check, ip_proto);
+}
+
+/* Same for an IPv6 address, from and to point at its 16 bytes */
+static __always_inline void l4_csum_replace16(__sum16 *check, int ip_proto,
+					      const __be32 *from,
+					      const __be32 *to)
+{
+	if (l4_csum_none(check, ip_proto))
+		return;
+	csum_replace16(check, from, to);
+	l4_csum_mangle_0(check, ip_proto);
+}
+
+#endif /* __CHECKSUM_HELPERS_H */
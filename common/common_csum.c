@@ -0,0 +1,160 @@
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define CSUM_NEON
+#endif
+
+#include "common_csum.h"
+
+static uint32_t csum_fold64(uint64_t s)
+{
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	return s;
+}
+
+/* Sum 32-bit words into 64 bits, which can't overflow for any sane length
+ * and folds to the same 16-bit sum, then the last bytes. The vector code
+ * uses it for the tail. */
+static uint32_t csum_tail(const uint8_t *p, size_t len, uint64_t s)
+{
+	uint32_t word32;
+	uint16_t word;
+
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&word32, p, 4);
+		s += word32;
+	}
+	if (len >= 2) {
+		memcpy(&word, p, 2);
+		s += word;
+		len -= 2;
+		p += 2;
+	}
+	if (len) {
+		word = 0;
+		memcpy(&word, p, 1);
+		s += word;
+	}
+	return csum_fold64(s);
+}
+
+uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum)
+{
+	return csum_tail(buf, len, sum);
+}
+
+#ifdef CSUM_AVX2
+/* 64 bytes per round, each 32-bit word zero-extended into a 64-bit lane */
+static __attribute__((target("avx2")))
+uint32_t csum_partial_avx2(const void *buf, size_t len, uint32_t sum)
+{
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+	const __m256i zero = _mm256_setzero_si256();
+	const uint8_t *p = buf;
+	uint64_t lanes[4];
+	__m256i v0, v1;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		v0 = _mm256_loadu_si256((const __m256i *)p);
+		v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	return csum_tail(p, len, (uint64_t)sum + lanes[0] + lanes[1] +
+			 lanes[2] + lanes[3]);
+}
+#endif
+
+#ifdef CSUM_NEON
+/* 32 bytes per round, pairwise adding 32-bit words into 64-bit lanes */
+static uint32_t csum_partial_neon(const void *buf, size_t len, uint32_t sum)
+{
+	uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+	const uint8_t *p = buf;
+
+	for (; len >= 32; len -= 32, p += 32) {
+		acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+		acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+	}
+
+	return csum_tail(p, len, (uint64_t)sum +
+			 vaddvq_u64(vaddq_u64(acc0, acc1)));
+}
+#endif
+
+static const struct {
+	const char *name;
+	csum_partial_fn fn;
+} csum_impls[] = {
+	/* Best first */
+#ifdef CSUM_AVX2
+	{ "avx2",   csum_partial_avx2 },
+#endif
+#ifdef CSUM_NEON
+	{ "neon",   csum_partial_neon },
+#endif
+	{ "scalar", csum_partial_scalar },
+};
+
+static bool csum_impl_supported(const char *name)
+{
+#ifdef CSUM_AVX2
+	if (!strcmp(name, "avx2")) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return true;
+}
+
+static int csum_best = -1;
+
+static int csum_best_impl(void)
+{
+	int i = __atomic_load_n(&csum_best, __ATOMIC_RELAXED);
+
+	if (i >= 0)
+		return i;
+	for (i = 0; !csum_impl_supported(csum_impls[i].name); i++)
+		;
+	__atomic_store_n(&csum_best, i, __ATOMIC_RELAXED);
+	return i;
+}
+
+csum_partial_fn csum_partial_impl(const char *name)
+{
+	unsigned int i;
+
+	if (!name)
+		return csum_impls[csum_best_impl()].fn;
+
+	for (i = 0; i < sizeof(csum_impls) / sizeof(csum_impls[0]); i++)
+		if (!strcmp(csum_impls[i].name, name))
+			return csum_impl_supported(name) ? csum_impls[i].fn : NULL;
+	return NULL;
+}
+
+const char *csum_partial_name(void)
+{
+	return csum_impls[csum_best_impl()].name;
+}
+
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+	/* Not worth a vector setup for pseudo headers and the like */
+	if (len < 64)
+		return csum_tail(buf, len, sum);
+	return csum_impls[csum_best_impl()].fn(buf, len, sum);
+}
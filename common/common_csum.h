@@ -0,0 +1,124 @@
+/* Internet checksum (RFC 1071) helpers for userspace programs.
+ *
+ * Sums are kept as 32-bit partial sums of the data as loaded in host order,
+ * which folds to the right checksum in network order on either endianness.
+ * csum_partial() picks a vectorized implementation for the running CPU:
+ * AVX2 on x86, NEON on arm64, or the scalar one. The incremental helpers
+ * (RFC 1624) update a checksum field for a rewritten header field without
+ * touching the rest of the packet.
+ */
+#ifndef __COMMON_CSUM_H
+#define __COMMON_CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+
+typedef uint32_t (*csum_partial_fn)(const void *buf, size_t len,
+				    uint32_t sum);
+
+/* Add the 16-bit words of buf to sum, returns a sum of at most 0xffff, so
+ * callers can add a few more words before folding */
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum);
+
+/* The implementations behind csum_partial(), e.g. to compare them */
+uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum);
+
+/* Look up an implementation by name ("scalar", "avx2" or "neon"), or the
+ * best one with name NULL. Returns NULL if this CPU can't run it. */
+csum_partial_fn csum_partial_impl(const char *name);
+
+/* Name of the implementation used by csum_partial() */
+const char *csum_partial_name(void);
+
+static inline __sum16 csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (__sum16)~sum;
+}
+
+/* Partial sum of the IPv4 TCP/UDP pseudo header, with len the L4 length
+ * in host order */
+static inline uint32_t csum_tcpudp_ipv4(__be32 saddr, __be32 daddr,
+					uint32_t len, uint8_t proto,
+					uint32_t sum)
+{
+	sum = csum_partial(&saddr, sizeof(saddr), sum);
+	sum = csum_partial(&daddr, sizeof(daddr), sum);
+	sum += htons(proto);
+	sum += htons(len);
+	return sum;
+}
+
+/* Same for IPv6, saddr and daddr point at the 16-byte addresses */
+static inline uint32_t csum_tcpudp_ipv6(const void *saddr, const void *daddr,
+					uint32_t len, uint8_t proto,
+					uint32_t sum)
+{
+	sum = csum_partial(saddr, 16, sum);
+	sum = csum_partial(daddr, 16, sum);
+	sum += htons(proto);
+	sum += htons(len >> 16);
+	sum += htons(len & 0xffff);
+	return sum;
+}
+
+/* Add the sum of a block that starts offset bytes into the data, whose
+ * words are byte-swapped relative to the data if offset is odd */
+static inline uint32_t csum_block_add(uint32_t sum, uint32_t sum2,
+				      size_t offset)
+{
+	sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+	sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+	if (offset & 1)
+		sum2 = ((sum2 & 0xff) << 8) | (sum2 >> 8);
+	sum += sum2;
+	return sum + (sum < sum2);
+}
+
+static inline __sum16 csum16_add(__sum16 csum, __be16 addend)
+{
+	uint16_t res = (uint16_t)csum;
+
+	res += (__u16)addend;
+	return (__sum16)(res + (res < (__u16)addend));
+}
+
+static inline __sum16 csum16_sub(__sum16 csum, __be16 addend)
+{
+	return csum16_add(csum, ~addend);
+}
+
+/* Update checksum *sum for a field changing from old to new */
+static inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
+{
+	*sum = ~csum16_add(csum16_sub(~(*sum), old), new);
+}
+
+static inline void csum_replace4(__sum16 *sum, __be32 old, __be32 new)
+{
+	__be16 o[2], n[2];
+
+	memcpy(o, &old, sizeof(o));
+	memcpy(n, &new, sizeof(n));
+	csum_replace2(sum, o[0], n[0]);
+	csum_replace2(sum, o[1], n[1]);
+}
+
+/* For IPv6 addresses, old and new point at 16 bytes */
+static inline void csum_replace16(__sum16 *sum, const void *old,
+				  const void *new)
+{
+	__be16 o[8], n[8];
+	int i;
+
+	memcpy(o, old, sizeof(o));
+	memcpy(n, new, sizeof(n));
+	for (i = 0; i < 8; i++)
+		csum_replace2(sum, o[i], n[i]);
+}
+
+#endif /* __COMMON_CSUM_H */
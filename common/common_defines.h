@@ -25,7 +25,35 @@ struct config {
 	char dest_mac[18];
 	__u16 xsk_bind_flags;
 	int xsk_if_queue;
+	int xsk_queue_count;
+	char xsk_cpu_list[64];
 	bool xsk_poll_mode;
+	bool xsk_busy_poll;
+	bool xsk_shared_umem;
+	bool xsk_hugepages;
+	__u32 xsk_frames;
+	__u32 xsk_frame_size;
+	__u32 xsk_rx_size;
+	__u32 xsk_tx_size;
+	__u32 xsk_fill_size;
+	__u32 xsk_comp_size;
+	__u32 xsk_rx_batch;
+	__u32 xsk_tx_batch;
+	char xsk_handler[512];
+	char xsk_handler_args[256];
+	char xsk_pass_dev[IF_NAMESIZE];
+	char xsk_rules[512];
+	bool xsk_rx_metadata;
+	bool xsk_tx_only;
+	__u32 xsk_tx_rate;
+	__u32 xsk_tx_pkt_size;
+	__u32 xsk_tx_flows;
+	char xsk_ctrl_sock[108]; /* sizeof(sun_path) */
+	bool xsk_af_packet;
+	bool xsk_flow_hash;
+	bool xsk_tx_csum_offload;
+	char xsk_fwd_dst_mac[18];
+	char xsk_fwd_redirect_dst_mac[18];
 	bool unload_all;
 };
 
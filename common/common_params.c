@@ -10,6 +10,10 @@
 #include <linux/if_link.h> /* XDP_FLAGS_* depend on kernel-headers installed */
 #include <linux/if_xdp.h>
 
+#ifndef XDP_USE_SG /* Multi-buffer AF_XDP, since kernel v6.6 */
+#define XDP_USE_SG (1 << 4)
+#endif
+
 #include "common_params.h"
 
 int verbose = 1;
@@ -155,6 +159,118 @@ void parse_cmdline_args(int argc, char **argv,
 		case 'Q':
 			cfg->xsk_if_queue = atoi(optarg);
 			break;
+		case 5: /* --queue-count */
+			cfg->xsk_queue_count = atoi(optarg);
+			if (cfg->xsk_queue_count < 1) {
+				fprintf(stderr, "ERR: --queue-count must be >= 1\n");
+				goto error;
+			}
+			break;
+		case 6: /* --cpu-list */
+			dest  = (char *)&cfg->xsk_cpu_list;
+			strncpy(dest, optarg, sizeof(cfg->xsk_cpu_list) - 1);
+			break;
+		case 7: /* --need-wakeup */
+			cfg->xsk_bind_flags |= XDP_USE_NEED_WAKEUP;
+			break;
+		case 8: /* --busy-poll */
+			cfg->xsk_busy_poll = true;
+			break;
+		case 9: /* --shared-umem */
+			cfg->xsk_shared_umem = true;
+			break;
+		case 10: /* --frames */
+			cfg->xsk_frames = atoi(optarg);
+			break;
+		case 11: /* --frame-size */
+			cfg->xsk_frame_size = atoi(optarg);
+			if (cfg->xsk_frame_size != 2048 &&
+			    cfg->xsk_frame_size != 4096) {
+				fprintf(stderr, "ERR: --frame-size must be 2048 or 4096\n");
+				goto error;
+			}
+			break;
+		case 12: /* --hugepages */
+			cfg->xsk_hugepages = true;
+			break;
+		case 13: /* --rx-ring */
+			cfg->xsk_rx_size = atoi(optarg);
+			break;
+		case 14: /* --tx-ring */
+			cfg->xsk_tx_size = atoi(optarg);
+			break;
+		case 15: /* --fill-ring */
+			cfg->xsk_fill_size = atoi(optarg);
+			break;
+		case 16: /* --comp-ring */
+			cfg->xsk_comp_size = atoi(optarg);
+			break;
+		case 17: /* --rx-batch */
+			cfg->xsk_rx_batch = atoi(optarg);
+			break;
+		case 18: /* --tx-batch */
+			cfg->xsk_tx_batch = atoi(optarg);
+			break;
+		case 19: /* --handler */
+			dest  = (char *)&cfg->xsk_handler;
+			strncpy(dest, optarg, sizeof(cfg->xsk_handler) - 1);
+			break;
+		case 20: /* --handler-args */
+			dest  = (char *)&cfg->xsk_handler_args;
+			strncpy(dest, optarg, sizeof(cfg->xsk_handler_args) - 1);
+			break;
+		case 21: /* --pass-dev */
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --pass-dev name too long\n");
+				goto error;
+			}
+			dest  = (char *)&cfg->xsk_pass_dev;
+			strncpy(dest, optarg, IF_NAMESIZE - 1);
+			break;
+		case 22: /* --rules */
+			dest  = (char *)&cfg->xsk_rules;
+			strncpy(dest, optarg, sizeof(cfg->xsk_rules) - 1);
+			break;
+		case 23: /* --multi-buffer */
+			cfg->xsk_bind_flags |= XDP_USE_SG;
+			break;
+		case 24: /* --rx-metadata */
+			cfg->xsk_rx_metadata = true;
+			break;
+		case 25: /* --tx-only */
+			cfg->xsk_tx_only = true;
+			break;
+		case 26: /* --tx-rate */
+			cfg->xsk_tx_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 27: /* --tx-size */
+			cfg->xsk_tx_pkt_size = atoi(optarg);
+			break;
+		case 28: /* --tx-flows */
+			cfg->xsk_tx_flows = atoi(optarg);
+			break;
+		case 29: /* --ctrl-sock */
+			dest  = (char *)&cfg->xsk_ctrl_sock;
+			strncpy(dest, optarg, sizeof(cfg->xsk_ctrl_sock) - 1);
+			break;
+		case 30: /* --af-packet */
+			cfg->xsk_af_packet = true;
+			break;
+		case 31: /* --flow-hash */
+			cfg->xsk_flow_hash = true;
+			break;
+		case 32: /* --tx-csum-offload */
+			cfg->xsk_tx_csum_offload = true;
+			break;
+		case 33: /* --fwd-dst-mac */
+			dest  = (char *)&cfg->xsk_fwd_dst_mac;
+			strncpy(dest, optarg, sizeof(cfg->xsk_fwd_dst_mac) - 1);
+			break;
+		case 34: /* --fwd-redirect-dst-mac */
+			dest  = (char *)&cfg->xsk_fwd_redirect_dst_mac;
+			strncpy(dest, optarg,
+				sizeof(cfg->xsk_fwd_redirect_dst_mac) - 1);
+			break;
 		case 1: /* --filename */
 			dest  = (char *)&cfg->filename;
 			strncpy(dest, optarg, sizeof(cfg->filename));
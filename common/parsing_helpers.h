@@ -9,7 +9,16 @@
  *
  * For Ethernet and IP headers, the content type is the type of the payload
  * (h_proto for Ethernet, nexthdr for IPv6), for ICMP it is the ICMP type field.
- * All return values are in host byte order.
+ * All return values are in host byte order. parse_ip6hdr_ext() also skips the
+ * IPv6 extension headers, and returns the upper-layer protocol after them.
+ *
+ * The tunnel parsers (VXLAN, GENEVE, GRE and IPIP) leave the cursor at the
+ * inner packet and return its EtherType in network byte order, like
+ * parse_ethhdr(): ETH_P_TEB for an inner Ethernet header, or ETH_P_IP or
+ * ETH_P_IPV6 for an inner IP header.
+ *
+ * parse_pkt_meta() runs the whole Ethernet, IP and L4 ladder at once and
+ * collects the result in a struct pkt_meta.
  *
  * The versions of the functions included here are slightly expanded versions of
  * the functions in the packet01 lesson. For instance, the Ethernet header
@@ -22,6 +31,7 @@
 #include <stddef.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/in.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/icmp.h>
@@ -54,11 +64,81 @@ struct icmphdr_common {
 	__sum16	cksum;
 };
 
+/*
+ *	struct vxlanhdr - VXLAN header (RFC 7348)
+ *	@vx_flags: VXLAN_F_VNI must be set
+ *	@vx_vni: VNI in the upper 24 bits
+ */
+struct vxlanhdr {
+	__be32	vx_flags;
+	__be32	vx_vni;
+};
+
+#define VXLAN_PORT		4789
+#define VXLAN_F_VNI		0x08000000
+
+/*
+ *	struct genevehdr - GENEVE header (RFC 8926), followed by options
+ *	@ver_opt_len: version (upper 2 bits) and options length in 4-byte units
+ *	@protocol_type: EtherType of the inner packet
+ */
+struct genevehdr {
+	__u8	ver_opt_len;
+	__u8	flags;
+	__be16	protocol_type;
+	__u8	vni[3];
+	__u8	reserved;
+};
+
+#define GENEVE_PORT		6081
+#define GENEVE_VER_MASK		0xc0
+#define GENEVE_OPT_LEN_MASK	0x3f
+
+/*
+ *	struct gre_base_hdr - GRE header (RFC 2784, RFC 2890), followed by
+ *	the optional checksum, key and sequence number fields set in @flags
+ */
+struct gre_base_hdr {
+	__be16	flags;
+	__be16	protocol;
+};
+
+#define GRE_F_CSUM		0x8000
+#define GRE_F_ROUTING		0x4000
+#define GRE_F_KEY		0x2000
+#define GRE_F_SEQ		0x1000
+#define GRE_F_VERSION		0x0007
+
 /* Allow users of header file to redefine VLAN max depth */
 #ifndef VLAN_MAX_DEPTH
 #define VLAN_MAX_DEPTH 2
 #endif
 
+/* Allow users of header file to redefine the number of IPv6 extension
+ * headers skipped before giving up on a packet
+ */
+#ifndef IPV6_EXT_MAX_CHAIN
+#define IPV6_EXT_MAX_CHAIN 6
+#endif
+
+/*
+ *	struct ipv6_frag_hdr - IPv6 Fragment extension header
+ *	@frag_off: fragment offset in 8-byte units, and the More Fragments bit
+ */
+struct ipv6_frag_hdr {
+	__u8	nexthdr;
+	__u8	reserved;
+	__be16	frag_off;
+	__be32	identification;
+};
+
+#define IPV6_FRAG_OFFSET	0xfff8
+#define IPV6_FRAG_MF		0x0001
+
+/* Flags set by skip_ip6hdrext() */
+#define IPV6_EXT_FRAG		(1 << 0) /* Packet is a fragment */
+#define IPV6_EXT_FRAG_LATER	(1 << 1) /* Not the first one, no L4 header */
+
 #define VLAN_VID_MASK		0x0fff /* VLAN Identifier */
 /* Struct for collecting VLANs after parsing via parse_ethhdr_vlan */
 struct collect_vlans {
@@ -148,6 +228,96 @@ static __always_inline int parse_ip6hdr(struct hdr_cursor *nh,
 	return ip6h->nexthdr;
 }
 
+/* Skip the IPv6 extension headers at nh, with next_hdr_type the type of the
+ * first one. Returns the upper-layer protocol with nh at its header, or -1
+ * when the chain is cut short or has more than IPV6_EXT_MAX_CHAIN headers.
+ * A fragment sets IPV6_EXT_FRAG in *flags; for all but the first fragment of
+ * a packet IPV6_EXT_FRAG_LATER is also set, and nh is then at the fragment
+ * data.
+ */
+static __always_inline int skip_ip6hdrext(struct hdr_cursor *nh,
+					  void *data_end,
+					  __u8 next_hdr_type,
+					  __u32 *flags)
+{
+	struct ipv6_frag_hdr *fragh;
+	struct ipv6_opt_hdr *hdr;
+	int i;
+
+	#pragma unroll
+	for (i = 0; i < IPV6_EXT_MAX_CHAIN; i++) {
+		hdr = nh->pos;
+
+		switch (next_hdr_type) {
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_DSTOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_MH:
+			if (hdr + 1 > data_end)
+				return -1;
+			/* Length in 8-byte units, not counting the first 8 */
+			nh->pos = (char *)hdr + (hdr->hdrlen + 1) * 8;
+			next_hdr_type = hdr->nexthdr;
+			break;
+		case IPPROTO_AH:
+			if (hdr + 1 > data_end)
+				return -1;
+			/* Length in 4-byte units, minus 2 */
+			nh->pos = (char *)hdr + (hdr->hdrlen + 2) * 4;
+			next_hdr_type = hdr->nexthdr;
+			break;
+		case IPPROTO_FRAGMENT:
+			fragh = nh->pos;
+			if (fragh + 1 > data_end)
+				return -1;
+			nh->pos = fragh + 1;
+			*flags |= IPV6_EXT_FRAG;
+			/* What follows a later fragment is data, not headers */
+			if (fragh->frag_off & bpf_htons(IPV6_FRAG_OFFSET)) {
+				*flags |= IPV6_EXT_FRAG_LATER;
+				return fragh->nexthdr;
+			}
+			next_hdr_type = fragh->nexthdr;
+			break;
+		default:
+			/* Upper-layer protocol, or IPPROTO_NONE */
+			return next_hdr_type;
+		}
+	}
+
+	/* A chain of exactly IPV6_EXT_MAX_CHAIN headers is fine, as long as
+	 * no further extension header follows */
+	switch (next_hdr_type) {
+	case IPPROTO_HOPOPTS:
+	case IPPROTO_DSTOPTS:
+	case IPPROTO_ROUTING:
+	case IPPROTO_MH:
+	case IPPROTO_AH:
+	case IPPROTO_FRAGMENT:
+		return -1;
+	default:
+		return next_hdr_type;
+	}
+}
+
+/* Like parse_ip6hdr(), but also skips the extension headers, see
+ * skip_ip6hdrext() for the return value and *flags.
+ */
+static __always_inline int parse_ip6hdr_ext(struct hdr_cursor *nh,
+					    void *data_end,
+					    struct ipv6hdr **ip6hdr,
+					    __u32 *flags)
+{
+	int nexthdr;
+
+	*flags = 0;
+	nexthdr = parse_ip6hdr(nh, data_end, ip6hdr);
+	if (nexthdr < 0)
+		return -1;
+
+	return skip_ip6hdrext(nh, data_end, nexthdr, flags);
+}
+
 static __always_inline int parse_iphdr(struct hdr_cursor *nh,
 				       void *data_end,
 				       struct iphdr **iphdr)
@@ -269,4 +439,261 @@ static __always_inline int parse_tcphdr(struct hdr_cursor *nh,
 	return len;
 }
 
+/*
+ * parse_vxlanhdr: with nh after the outer UDP header, skip the VXLAN header
+ */
+static __always_inline int parse_vxlanhdr(struct hdr_cursor *nh,
+					  void *data_end,
+					  struct vxlanhdr **vxlanhdr)
+{
+	struct vxlanhdr *h = nh->pos;
+
+	if (h + 1 > data_end)
+		return -1;
+
+	if (!(h->vx_flags & bpf_htonl(VXLAN_F_VNI)))
+		return -1;
+
+	nh->pos = h + 1;
+	*vxlanhdr = h;
+
+	return bpf_htons(ETH_P_TEB);
+}
+
+/*
+ * parse_genevehdr: with nh after the outer UDP header, skip the GENEVE header
+ * and its options
+ */
+static __always_inline int parse_genevehdr(struct hdr_cursor *nh,
+					   void *data_end,
+					   struct genevehdr **genevehdr)
+{
+	struct genevehdr *h = nh->pos;
+	int len;
+
+	if (h + 1 > data_end)
+		return -1;
+
+	if (h->ver_opt_len & GENEVE_VER_MASK)
+		return -1;
+
+	len = sizeof(*h) + (h->ver_opt_len & GENEVE_OPT_LEN_MASK) * 4;
+	if (nh->pos + len > data_end)
+		return -1;
+
+	nh->pos += len;
+	*genevehdr = h;
+
+	return h->protocol_type;
+}
+
+/*
+ * parse_grehdr: skip the GRE header and its optional fields, storing the key
+ * (network byte order, 0 without one) in *key if key isn't NULL. Only GRE
+ * version 0 without source routing is supported.
+ */
+static __always_inline int parse_grehdr(struct hdr_cursor *nh,
+					void *data_end,
+					struct gre_base_hdr **grehdr,
+					__be32 *key)
+{
+	struct gre_base_hdr *h = nh->pos;
+	int len = sizeof(*h);
+	__be32 *keyp;
+
+	if (h + 1 > data_end)
+		return -1;
+
+	if (h->flags & bpf_htons(GRE_F_ROUTING | GRE_F_VERSION))
+		return -1;
+
+	if (h->flags & bpf_htons(GRE_F_CSUM))
+		len += 4;
+	if (h->flags & bpf_htons(GRE_F_KEY)) {
+		keyp = nh->pos + len;
+		if (keyp + 1 > data_end)
+			return -1;
+		if (key)
+			*key = *keyp;
+		len += 4;
+	} else if (key) {
+		*key = 0;
+	}
+	if (h->flags & bpf_htons(GRE_F_SEQ))
+		len += 4;
+
+	if (nh->pos + len > data_end)
+		return -1;
+
+	nh->pos += len;
+	*grehdr = h;
+
+	return h->protocol;
+}
+
+/*
+ * parse_ipip: for IP-in-IP (IPPROTO_IPIP) and IPv6-in-IP (IPPROTO_IPV6)
+ * there is no tunnel header, nh is at the inner IP header already
+ */
+static __always_inline int parse_ipip(struct hdr_cursor *nh,
+				      void *data_end,
+				      int ip_type)
+{
+	if (ip_type == IPPROTO_IPIP)
+		return bpf_htons(ETH_P_IP);
+	if (ip_type == IPPROTO_IPV6)
+		return bpf_htons(ETH_P_IPV6);
+	return -1;
+}
+
+/*
+ * parse_tunnel: with nh after the outer L4 header of protocol ip_type (and
+ * dport its destination port for UDP), find the inner packet of any of the
+ * tunnels above, by their standard UDP ports
+ */
+static __always_inline int parse_tunnel(struct hdr_cursor *nh,
+					void *data_end,
+					int ip_type, __be16 dport)
+{
+	struct gre_base_hdr *gre;
+	struct genevehdr *geneve;
+	struct vxlanhdr *vxlan;
+
+	switch (ip_type) {
+	case IPPROTO_IPIP:
+	case IPPROTO_IPV6:
+		return parse_ipip(nh, data_end, ip_type);
+	case IPPROTO_GRE:
+		return parse_grehdr(nh, data_end, &gre, NULL);
+	case IPPROTO_UDP:
+		if (dport == bpf_htons(VXLAN_PORT))
+			return parse_vxlanhdr(nh, data_end, &vxlan);
+		if (dport == bpf_htons(GENEVE_PORT))
+			return parse_genevehdr(nh, data_end, &geneve);
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+/* Flags in struct pkt_meta, the same bits as skip_ip6hdrext() sets */
+#define PKT_META_F_FRAG		IPV6_EXT_FRAG	    /* Packet is a fragment */
+#define PKT_META_F_FRAG_LATER	IPV6_EXT_FRAG_LATER /* Not the first one, no
+						     * L4 header */
+
+/* Everything parse_pkt_meta() found out about a packet in one pass, so that
+ * the stages of a program (filtering, stats, redirect) don't each repeat the
+ * parse. Offsets count from the start of the Ethernet header. The addresses
+ * are normalized to 16 bytes, IPv4 as an IPv4-mapped IPv6 address
+ * (::ffff:a.b.c.d), so a single 5-tuple covers both families.
+ */
+struct pkt_meta {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;		/* TCP/UDP ports, 0 for other protocols */
+	__be16 dport;
+	__be16 eth_proto;	/* EtherType after the VLAN tags */
+	__u16 l3_off;
+	__u16 l4_off;		/* 0 for non-first fragments */
+	__u16 payload_off;	/* After the TCP/UDP header, else as l4_off */
+	struct collect_vlans vlans;
+	__u8 nr_vlans;
+	__u8 ip_proto;		/* After any IPv6 extension headers */
+	__u8 tcp_flags;		/* FIN to CWR, as in the TCP header */
+	__u8 flags;		/* PKT_META_F_* */
+};
+
+/*
+ * parse_pkt_meta_ip: the IP and L4 part of parse_pkt_meta(), for an IP packet
+ * at nh whose EtherType is eth_type, such as the inner packet of a tunnel.
+ * Offsets count from data, and meta must be zeroed by the caller.
+ */
+static __always_inline int parse_pkt_meta_ip(struct hdr_cursor *nh,
+					     void *data, void *data_end,
+					     int eth_type,
+					     struct pkt_meta *meta)
+{
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+	__u32 ext_flags;
+	int ip_type;
+
+	meta->eth_proto = eth_type;
+	meta->l3_off = nh->pos - data;
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(nh, data_end, &iph);
+		if (ip_type < 0)
+			return -1;
+		meta->saddr[2] = bpf_htonl(0xffff);
+		meta->saddr[3] = iph->saddr;
+		meta->daddr[2] = bpf_htonl(0xffff);
+		meta->daddr[3] = iph->daddr;
+
+		/* MF set or a fragment offset */
+		if (iph->frag_off & bpf_htons(0x3fff))
+			meta->flags |= PKT_META_F_FRAG;
+		if (iph->frag_off & bpf_htons(0x1fff))
+			meta->flags |= PKT_META_F_FRAG_LATER;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr_ext(nh, data_end, &ip6h, &ext_flags);
+		if (ip_type < 0)
+			return -1;
+		__builtin_memcpy(meta->saddr, &ip6h->saddr, sizeof(meta->saddr));
+		__builtin_memcpy(meta->daddr, &ip6h->daddr, sizeof(meta->daddr));
+		meta->flags |= ext_flags;
+	} else {
+		return -1;
+	}
+
+	meta->ip_proto = ip_type;
+	if (meta->flags & PKT_META_F_FRAG_LATER)
+		return ip_type;
+
+	meta->l4_off = nh->pos - data;
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(nh, data_end, &tcph) < 0)
+			return -1;
+		meta->sport = tcph->source;
+		meta->dport = tcph->dest;
+		/* The byte after doff, the kernel's tcp_flag_byte() */
+		meta->tcp_flags = ((__u8 *)tcph)[13];
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(nh, data_end, &udph) < 0)
+			return -1;
+		meta->sport = udph->source;
+		meta->dport = udph->dest;
+	}
+	meta->payload_off = nh->pos - data;
+
+	return ip_type;
+}
+
+/*
+ * parse_pkt_meta: parse the Ethernet, VLAN, IP and TCP/UDP headers of the
+ * packet at nh in one go, filling in meta. Returns the IP protocol with nh
+ * after the last header parsed, or -1 if the packet isn't IP or is cut short,
+ * in which case meta holds what was found before that.
+ */
+static __always_inline int parse_pkt_meta(struct hdr_cursor *nh,
+					  void *data_end,
+					  struct pkt_meta *meta)
+{
+	void *data = nh->pos;
+	struct ethhdr *eth;
+	int eth_type;
+
+	__builtin_memset(meta, 0, sizeof(*meta));
+
+	eth_type = parse_ethhdr_vlan(nh, data_end, &eth, &meta->vlans);
+	if (eth_type < 0)
+		return -1;
+	meta->nr_vlans = (nh->pos - data - sizeof(*eth)) /
+			 sizeof(struct vlan_hdr);
+
+	return parse_pkt_meta_ip(nh, data, data_end, eth_type, meta);
+}
+
 #endif /* __PARSING_HELPERS_H */
@@ -11,11 +11,23 @@
 #include <linux/bpf.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/udp.h>
 #include <linux/if_ether.h>
 
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 
+#include "checksum_helpers.h"
+#include "tunnel_kern_user.h"
+
+/* Keeps the compiler from folding the checks on either side of it into one,
+ * e.g. a < x < b into a single compare of x - a, of which the verifier then
+ * learns the range instead of that of x. Newer libbpf has it too.
+ */
+#ifndef barrier_var
+#define barrier_var(var) asm volatile("" : "=r"(var) : "0"(var))
+#endif
+
 /* Pops the outermost VLAN tag off the packet. Returns the popped VLAN ID on
  * success or negative errno on failure.
  */
@@ -141,4 +153,126 @@ static __always_inline void swap_src_dst_ipv4(struct iphdr *iphdr)
 	iphdr->daddr = tmp;
 }
 
+/* Strips the outer headers of a tunnelled packet, with inner pointing at the
+ * inner packet and inner_type its EtherType, as found by parse_tunnel(). An
+ * inner Ethernet frame becomes the packet, an inner IP packet gets the outer
+ * Ethernet header (without VLAN tags) with its h_proto set to inner_type.
+ * Returns 0 on success, -1 on failure. The packet may have been changed
+ * already when it fails, so the caller must drop it then (XDP_DROP).
+ */
+static __always_inline int tunnel_decap(struct xdp_md *ctx, void *inner,
+					int inner_type)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct ethhdr *eth = data;
+	struct ethhdr eth_cpy;
+	int offset = inner - data;
+
+	if (inner_type == bpf_htons(ETH_P_TEB))
+		return bpf_xdp_adjust_head(ctx, offset) ? -1 : 0;
+
+	if (inner_type != bpf_htons(ETH_P_IP) &&
+	    inner_type != bpf_htons(ETH_P_IPV6))
+		return -1;
+
+	if (eth + 1 > data_end)
+		return -1;
+
+	/* Keep the outer Ethernet header for the inner IP packet */
+	__builtin_memcpy(&eth_cpy, eth, sizeof(eth_cpy));
+
+	if (bpf_xdp_adjust_head(ctx, offset - (int)sizeof(*eth)))
+		return -1;
+
+	eth = (void *)(long)ctx->data;
+	data_end = (void *)(long)ctx->data_end;
+	if (eth + 1 > data_end)
+		return -1;
+
+	__builtin_memcpy(eth, &eth_cpy, sizeof(*eth));
+	eth->h_proto = inner_type;
+	return 0;
+}
+
+/* Pushes the outer headers of template t in front of the packet, see
+ * struct tunnel_encap, and fills in their length fields and the IPv4 header
+ * checksum. A non-zero sport replaces the UDP source port of the template,
+ * e.g. with a hash of the inner flow for ECMP and RSS entropy. The outer
+ * UDP checksum is left 0, which RFC 7348 allows for IPv4 and RFC 6935 for
+ * IPv6 tunnels. Returns 0 on success, -1 on failure. Like for
+ * tunnel_decap(), a failure can come after the packet has grown by the
+ * template, the caller must then drop it (XDP_DROP).
+ */
+static __always_inline int tunnel_encap(struct xdp_md *ctx,
+					struct tunnel_encap *t, __be16 sport)
+{
+	__u32 len = t->len, l3_off = t->l3_off, udp_off = t->udp_off;
+	void *data_end, *data;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	__u32 strip, inner_len, csum;
+
+	/* Explicit bounds for the verifier, on each of the offsets */
+	if (len > TUNNEL_ENCAP_MAX_LEN)
+		return -1;
+	barrier_var(len);
+	if (len < sizeof(*eth) + sizeof(*iph))
+		return -1;
+	if (l3_off > TUNNEL_ENCAP_MAX_LEN)
+		return -1;
+	barrier_var(l3_off);
+	if (l3_off < sizeof(*eth) || udp_off > TUNNEL_ENCAP_MAX_LEN)
+		return -1;
+
+	/* An inner IP packet goes without its own Ethernet header */
+	strip = t->inner_eth ? 0 : sizeof(*eth);
+	inner_len = bpf_xdp_get_buff_len(ctx) - strip;
+
+	if (bpf_xdp_adjust_head(ctx, (int)strip - (int)len))
+		return -1;
+	if (bpf_xdp_store_bytes(ctx, 0, t->hdr, len))
+		return -1;
+
+	data = (void *)(long)ctx->data;
+	data_end = (void *)(long)ctx->data_end;
+	eth = data;
+	if (eth + 1 > data_end)
+		return -1;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		iph = data + l3_off;
+		if (iph + 1 > data_end || iph->ihl != 5)
+			return -1;
+
+		iph->tot_len = bpf_htons(inner_len + len - l3_off);
+		iph->check = 0;
+		csum = bpf_csum_diff(0, 0, (__be32 *)iph, sizeof(*iph), 0);
+		iph->check = csum_fold(csum);
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		ip6h = data + l3_off;
+		if (ip6h + 1 > data_end)
+			return -1;
+
+		ip6h->payload_len = bpf_htons(inner_len + len - l3_off -
+					      sizeof(*ip6h));
+	} else {
+		return -1;
+	}
+
+	if (udp_off) {
+		udph = data + udp_off;
+		if (udph + 1 > data_end)
+			return -1;
+
+		udph->len = bpf_htons(inner_len + len - udp_off);
+		udph->check = 0;
+		if (sport)
+			udph->source = sport;
+	}
+	return 0;
+}
+
 #endif /* __REWRITE_HELPERS_H */
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used by BPF-prog kernel side BPF-progs and userspace programs,
+ * for sharing the tunnel_encap() header template of rewrite_helpers.h.
+ */
+#ifndef __TUNNEL_KERN_USER_H
+#define __TUNNEL_KERN_USER_H
+
+#include <linux/types.h>
+
+#define TUNNEL_ENCAP_MAX_LEN 128
+
+/* Outer headers pushed by tunnel_encap(), prebuilt by user space and kept
+ * in a map: an Ethernet header, an IPv4 header without options or an IPv6
+ * header, and then a UDP header followed by a VXLAN or GENEVE header, a GRE
+ * header, or nothing for IPIP. The IP and UDP length fields and the IPv4
+ * header checksum are filled in for each packet.
+ */
+struct tunnel_encap {
+	__u16 len;		/* Bytes of hdr in use */
+	__u16 l3_off;		/* Offset of the outer IP header in hdr */
+	__u16 udp_off;		/* Offset of the outer UDP header, 0 if none */
+	__u8 inner_eth;		/* Keep the Ethernet header of the packet
+				 * (VXLAN, GENEVE, GRE with ETH_P_TEB), else
+				 * hdr replaces it (IPIP, GRE with IP) */
+	__u8 pad;
+	__u8 hdr[TUNNEL_ENCAP_MAX_LEN];
+};
+
+#endif /* __TUNNEL_KERN_USER_H */
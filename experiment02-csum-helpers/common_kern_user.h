@@ -0,0 +1,16 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+/* What the rewrites in xdp_csum_kern.c write, set by xdp_csum_test before
+ * each packet. Network byte order.
+ */
+struct csum_cfg {
+	__be32 addr[4];		/* New destination address, IPv4 in addr[0] */
+	__be16 port;		/* New destination port */
+	__u16 pad;
+};
+
+#endif /* __COMMON_KERN_USER_H */
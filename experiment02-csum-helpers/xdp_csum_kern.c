@@ -0,0 +1,243 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/checksum_helpers.h"
+#include "common_kern_user.h"
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct csum_cfg);
+	__uint(max_entries, 1);
+} csum_cfg_map SEC(".maps");
+
+/* Each rewrite below comes in two programs: one keeping the checksums right
+ * with the checksum_helpers.h helpers (update = 1), which xdp_csum_test
+ * checks against a full recomputation, and a *_base one that only rewrites
+ * (update = 0), for the instruction count of the helpers alone.
+ */
+
+static __always_inline struct csum_cfg *get_cfg(void)
+{
+	__u32 key = 0;
+
+	return bpf_map_lookup_elem(&csum_cfg_map, &key);
+}
+
+/* The checksum field of the TCP, UDP or ICMPv6 header at nh, and in *dport
+ * the destination port, NULL for ICMPv6 */
+static __always_inline __sum16 *parse_l4(struct hdr_cursor *nh,
+					 void *data_end, int proto,
+					 __be16 **dport)
+{
+	struct icmp6hdr *icmp6h;
+	struct tcphdr *tcph;
+	struct udphdr *udph;
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (parse_tcphdr(nh, data_end, &tcph) < 0)
+			return NULL;
+		*dport = &tcph->dest;
+		return &tcph->check;
+	case IPPROTO_UDP:
+		if (parse_udphdr(nh, data_end, &udph) < 0)
+			return NULL;
+		*dport = &udph->dest;
+		return &udph->check;
+	case IPPROTO_ICMPV6:
+		if (parse_icmp6hdr(nh, data_end, &icmp6h) < 0)
+			return NULL;
+		*dport = NULL;
+		return &icmp6h->icmp6_cksum;
+	}
+	return NULL;
+}
+
+/* IPv4 TTL decrement: csum_replace2() */
+static __always_inline int rewrite_ttl(struct xdp_md *ctx, int update)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	__be16 old;
+
+	if (parse_ethhdr(&nh, data_end, &eth) != bpf_htons(ETH_P_IP) ||
+	    parse_iphdr(&nh, data_end, &iph) < 0)
+		return XDP_PASS;
+
+	/* The TTL shares its 16-bit word with the protocol */
+	old = *(__be16 *)&iph->ttl;
+	iph->ttl--;
+	if (update)
+		csum_replace2(&iph->check, old, *(__be16 *)&iph->ttl);
+	return XDP_TX;
+}
+
+/* TCP or UDP destination port, over IPv4 or IPv6: l4_csum_replace2() */
+static __always_inline int rewrite_port(struct xdp_md *ctx, int update)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct csum_cfg *cfg = get_cfg();
+	struct ipv6hdr *ip6h;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	__be16 *dport, old;
+	__sum16 *check;
+	int eth_type, proto;
+
+	if (!cfg)
+		return XDP_ABORTED;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP))
+		proto = parse_iphdr(&nh, data_end, &iph);
+	else if (eth_type == bpf_htons(ETH_P_IPV6))
+		proto = parse_ip6hdr(&nh, data_end, &ip6h);
+	else
+		return XDP_PASS;
+
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		return XDP_PASS;
+	check = parse_l4(&nh, data_end, proto, &dport);
+	if (!check || !dport)
+		return XDP_PASS;
+
+	old = *dport;
+	*dport = cfg->port;
+	if (update)
+		l4_csum_replace2(check, proto, old, cfg->port);
+	return XDP_TX;
+}
+
+/* IPv4 destination address: csum_replace4() for the IP header, and
+ * l4_csum_replace4() for the TCP and UDP pseudo header. ICMP has none.
+ */
+static __always_inline int rewrite_addr4(struct xdp_md *ctx, int update)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct csum_cfg *cfg = get_cfg();
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	__sum16 *check = NULL;
+	__be16 *dport;
+	__be32 old;
+	int proto;
+
+	if (!cfg)
+		return XDP_ABORTED;
+
+	if (parse_ethhdr(&nh, data_end, &eth) != bpf_htons(ETH_P_IP))
+		return XDP_PASS;
+	proto = parse_iphdr(&nh, data_end, &iph);
+	if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+		check = parse_l4(&nh, data_end, proto, &dport);
+		if (!check)
+			return XDP_PASS;
+	} else if (proto != IPPROTO_ICMP) {
+		return XDP_PASS;
+	}
+
+	old = iph->daddr;
+	iph->daddr = cfg->addr[0];
+	if (update) {
+		csum_replace4(&iph->check, old, cfg->addr[0]);
+		if (check)
+			l4_csum_replace4(check, proto, old, cfg->addr[0]);
+	}
+	return XDP_TX;
+}
+
+/* IPv6 destination address: l4_csum_replace16() for TCP and UDP, and
+ * csum_replace16() for ICMPv6, whose checksum covers the pseudo header too
+ * but has no special case for 0
+ */
+static __always_inline int rewrite_addr6(struct xdp_md *ctx, int update)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct csum_cfg *cfg = get_cfg();
+	struct ipv6hdr *ip6h;
+	struct ethhdr *eth;
+	__be32 old[4];
+	__be16 *dport;
+	__sum16 *check;
+	int proto;
+
+	if (!cfg)
+		return XDP_ABORTED;
+
+	if (parse_ethhdr(&nh, data_end, &eth) != bpf_htons(ETH_P_IPV6))
+		return XDP_PASS;
+	proto = parse_ip6hdr(&nh, data_end, &ip6h);
+	check = parse_l4(&nh, data_end, proto, &dport);
+	if (!check)
+		return XDP_PASS;
+
+	__builtin_memcpy(old, &ip6h->daddr, sizeof(old));
+	__builtin_memcpy(&ip6h->daddr, cfg->addr, sizeof(old));
+	if (update) {
+		if (proto == IPPROTO_ICMPV6)
+			csum_replace16(check, old, cfg->addr);
+		else
+			l4_csum_replace16(check, proto, old, cfg->addr);
+	}
+	return XDP_TX;
+}
+
+SEC("xdp")
+int xdp_ttl(struct xdp_md *ctx)
+{
+	return rewrite_ttl(ctx, 1);
+}
+
+SEC("xdp")
+int xdp_ttl_base(struct xdp_md *ctx)
+{
+	return rewrite_ttl(ctx, 0);
+}
+
+SEC("xdp")
+int xdp_port(struct xdp_md *ctx)
+{
+	return rewrite_port(ctx, 1);
+}
+
+SEC("xdp")
+int xdp_port_base(struct xdp_md *ctx)
+{
+	return rewrite_port(ctx, 0);
+}
+
+SEC("xdp")
+int xdp_addr4(struct xdp_md *ctx)
+{
+	return rewrite_addr4(ctx, 1);
+}
+
+SEC("xdp")
+int xdp_addr4_base(struct xdp_md *ctx)
+{
+	return rewrite_addr4(ctx, 0);
+}
+
+SEC("xdp")
+int xdp_addr6(struct xdp_md *ctx)
+{
+	return rewrite_addr6(ctx, 1);
+}
+
+SEC("xdp")
+int xdp_addr6_base(struct xdp_md *ctx)
+{
+	return rewrite_addr6(ctx, 0);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,473 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ =
+	"Test of common/checksum_helpers.h through BPF_PROG_TEST_RUN\n"
+	"\n"
+	"Runs the programs of xdp_csum_kern.o on random packets, checks every\n"
+	"checksum they update against one computed from scratch, and prints the\n"
+	"instruction count of each program. Needs root.\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "common_kern_user.h"
+
+#define MAX_PAYLOAD 64
+#define PKT_SIZE (sizeof(struct ethhdr) + sizeof(struct ipv6hdr) + \
+		  sizeof(struct tcphdr) + MAX_PAYLOAD)
+
+enum rewrite {
+	REWRITE_TTL,
+	REWRITE_PORT,
+	REWRITE_ADDR4,
+	REWRITE_ADDR6,
+	REWRITE_MAX,
+};
+
+static const char *prog_names[REWRITE_MAX] = {
+	[REWRITE_TTL]	= "xdp_ttl",
+	[REWRITE_PORT]	= "xdp_port",
+	[REWRITE_ADDR4]	= "xdp_addr4",
+	[REWRITE_ADDR6]	= "xdp_addr6",
+};
+
+static const char *helper_names[REWRITE_MAX] = {
+	[REWRITE_TTL]	= "csum_replace2",
+	[REWRITE_PORT]	= "l4_csum_replace2",
+	[REWRITE_ADDR4]	= "csum_replace4 + l4_csum_replace4",
+	[REWRITE_ADDR6]	= "l4_csum_replace16 / csum_replace16",
+};
+
+/* The fields of a test packet, host byte order */
+struct pkt_desc {
+	int ipv6;
+	int proto;
+	__u32 saddr[4];
+	__u32 daddr[4];
+	__u16 sport;
+	__u16 dport;
+	__u8 ttl;
+	int udp_no_csum;	/* Send a UDP checksum of 0 */
+	int len;		/* Payload */
+	__u8 payload[MAX_PAYLOAD];
+};
+
+/* One's complement sum of the 16-bit big-endian words of buf */
+static __u32 csum_add(__u32 sum, const void *buf, int len)
+{
+	const __u8 *p = buf;
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	if (len & 1)
+		sum += p[len - 1] << 8;
+	return sum;
+}
+
+static __u16 csum_fold16(__u32 sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* The pseudo header sum for TCP, UDP and ICMPv6 */
+static __u32 pseudo_sum(const struct pkt_desc *d, int l4_len)
+{
+	__u32 sum = 0;
+	__u32 addrs[8];
+	int i, n = d->ipv6 ? 4 : 1;
+
+	for (i = 0; i < n; i++) {
+		addrs[i] = htonl(d->saddr[i]);
+		addrs[n + i] = htonl(d->daddr[i]);
+	}
+	sum = csum_add(sum, addrs, 8 * n);
+	return sum + d->proto + l4_len;
+}
+
+/* Write the frame for d into buf with all checksums computed in full, and
+ * return its length. In *l4_sum the sum of the L4 part with a checksum of 0,
+ * used to make the checksum come out as 0.
+ */
+static int build_pkt(__u8 *buf, const struct pkt_desc *d, __u32 *l4_sum)
+{
+	int l3_len = d->ipv6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr);
+	struct ethhdr *eth = (void *)buf;
+	__u8 *l4 = buf + sizeof(*eth) + l3_len;
+	int l4_hlen, l4_len, i;
+	__u16 *check;
+	__u32 sum;
+
+	memset(buf, 0, PKT_SIZE);
+	memset(eth->h_dest, 0x02, ETH_ALEN);
+	memset(eth->h_source, 0x04, ETH_ALEN);
+
+	switch (d->proto) {
+	case IPPROTO_TCP: {
+		struct tcphdr *tcph = (void *)l4;
+
+		tcph->source = htons(d->sport);
+		tcph->dest = htons(d->dport);
+		tcph->seq = htonl(0x01020304);
+		tcph->doff = sizeof(*tcph) / 4;
+		tcph->ack = 1;
+		tcph->window = htons(512);
+		check = &tcph->check;
+		l4_hlen = sizeof(*tcph);
+		break;
+	}
+	case IPPROTO_UDP: {
+		struct udphdr *udph = (void *)l4;
+
+		udph->source = htons(d->sport);
+		udph->dest = htons(d->dport);
+		udph->len = htons(sizeof(*udph) + d->len);
+		check = &udph->check;
+		l4_hlen = sizeof(*udph);
+		break;
+	}
+	case IPPROTO_ICMP: {
+		struct icmphdr *icmph = (void *)l4;
+
+		icmph->type = ICMP_ECHO;
+		icmph->un.echo.id = htons(d->sport);
+		icmph->un.echo.sequence = htons(d->dport);
+		check = &icmph->checksum;
+		l4_hlen = sizeof(*icmph);
+		break;
+	}
+	default: {
+		struct icmp6hdr *icmp6h = (void *)l4;
+
+		icmp6h->icmp6_type = ICMPV6_ECHO_REQUEST;
+		icmp6h->icmp6_identifier = htons(d->sport);
+		icmp6h->icmp6_sequence = htons(d->dport);
+		check = &icmp6h->icmp6_cksum;
+		l4_hlen = sizeof(*icmp6h);
+		break;
+	}
+	}
+	l4_len = l4_hlen + d->len;
+	memcpy(l4 + l4_hlen, d->payload, d->len);
+
+	if (d->ipv6) {
+		struct ipv6hdr *ip6h = (void *)(eth + 1);
+
+		eth->h_proto = htons(ETH_P_IPV6);
+		ip6h->version = 6;
+		ip6h->payload_len = htons(l4_len);
+		ip6h->nexthdr = d->proto;
+		ip6h->hop_limit = d->ttl;
+		for (i = 0; i < 4; i++) {
+			ip6h->saddr.s6_addr32[i] = htonl(d->saddr[i]);
+			ip6h->daddr.s6_addr32[i] = htonl(d->daddr[i]);
+		}
+	} else {
+		struct iphdr *iph = (void *)(eth + 1);
+
+		eth->h_proto = htons(ETH_P_IP);
+		iph->version = 4;
+		iph->ihl = sizeof(*iph) / 4;
+		iph->tot_len = htons(sizeof(*iph) + l4_len);
+		iph->ttl = d->ttl;
+		iph->protocol = d->proto;
+		iph->saddr = htonl(d->saddr[0]);
+		iph->daddr = htonl(d->daddr[0]);
+		iph->check = htons(~csum_fold16(csum_add(0, iph, sizeof(*iph))));
+	}
+
+	sum = csum_add(0, l4, l4_len);
+	if (d->proto != IPPROTO_ICMP)
+		sum += pseudo_sum(d, l4_len);
+	*l4_sum = csum_fold16(sum);
+
+	if (d->proto == IPPROTO_UDP && d->udp_no_csum)
+		*check = 0;
+	else if (d->proto == IPPROTO_UDP && *l4_sum == 0xffff)
+		*check = 0xffff;	/* CSUM_MANGLED_0 */
+	else
+		*check = htons(~*l4_sum);
+
+	return sizeof(*eth) + l3_len + l4_len;
+}
+
+/* Random, but with the all-zeros and all-ones values that lead to the carry
+ * corner cases of the one's complement sums more often than that */
+static __u32 random_val(void)
+{
+	switch (random() % 4) {
+	case 0:
+		return 0;
+	case 1:
+		return ~0U;
+	default:
+		return random() ^ (random() << 16);
+	}
+}
+
+static void random_desc(struct pkt_desc *d, enum rewrite rw)
+{
+	static const int protos4[] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP };
+	static const int protos6[] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMPV6 };
+	int i;
+
+	memset(d, 0, sizeof(*d));
+	switch (rw) {
+	case REWRITE_PORT:
+		d->ipv6 = random() & 1;
+		d->proto = random() & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+		break;
+	case REWRITE_ADDR6:
+		d->ipv6 = 1;
+		d->proto = protos6[random() % 3];
+		break;
+	default:
+		d->proto = protos4[random() % 3];
+		break;
+	}
+
+	for (i = 0; i < 4; i++) {
+		d->saddr[i] = random_val();
+		d->daddr[i] = random_val();
+	}
+	d->sport = random_val();
+	d->dport = random_val();
+	d->ttl = random_val();
+	d->udp_no_csum = !(random() % 4);
+	d->len = random() % (MAX_PAYLOAD + 1);
+	for (i = 0; i < d->len; i++)
+		d->payload[i] = random();
+}
+
+/* What the program should turn d into, given cfg */
+static void apply_rewrite(struct pkt_desc *d, enum rewrite rw,
+			  const struct csum_cfg *cfg)
+{
+	int i;
+
+	switch (rw) {
+	case REWRITE_TTL:
+		d->ttl--;
+		break;
+	case REWRITE_PORT:
+		d->dport = ntohs(cfg->port);
+		break;
+	case REWRITE_ADDR4:
+		d->daddr[0] = ntohl(cfg->addr[0]);
+		break;
+	default:
+		for (i = 0; i < 4; i++)
+			d->daddr[i] = ntohl(cfg->addr[i]);
+		break;
+	}
+}
+
+/* Change the first payload word so the L4 checksum of the rewritten
+ * packet comes out as 0, the UDP corner case. Returns 0 if there is no
+ * payload word to change.
+ */
+static int force_zero_csum(struct pkt_desc *d, const struct pkt_desc *after)
+{
+	__u8 buf[PKT_SIZE];
+	__u32 sum, w;
+
+	if (d->len < 2)
+		return 0;
+
+	build_pkt(buf, after, &sum);
+	w = (d->payload[0] << 8 | d->payload[1]) + (0xffff - sum);
+	w = csum_fold16(w);
+	d->payload[0] = w >> 8;
+	d->payload[1] = w;
+	return 1;
+}
+
+static void dump_pkt(const char *what, const __u8 *buf, int len)
+{
+	int i;
+
+	fprintf(stderr, "  %-8s", what);
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "%s%02x", i && !(i % 32) ? "\n          " : "",
+			buf[i]);
+	fprintf(stderr, "\n");
+}
+
+static int run_tests(int prog_fd, int map_fd, enum rewrite rw, int count)
+{
+	__u8 in[PKT_SIZE], out[PKT_SIZE + 64], expect[PKT_SIZE];
+	struct pkt_desc d, after;
+	struct csum_cfg cfg;
+	int i, j, len, fails = 0, zero_cases = 0;
+	__u32 key = 0, sum;
+
+	for (i = 0; i < count; i++) {
+		DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+				    .data_in = in,
+				    .data_out = out,
+				    .data_size_out = sizeof(out),
+				    .repeat = 1);
+
+		memset(&cfg, 0, sizeof(cfg));
+		for (j = 0; j < 4; j++)
+			cfg.addr[j] = random_val();
+		cfg.port = random_val();
+		if (bpf_map_update_elem(map_fd, &key, &cfg, 0)) {
+			fprintf(stderr, "ERR: updating csum_cfg_map: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		random_desc(&d, rw);
+		after = d;
+		apply_rewrite(&after, rw, &cfg);
+
+		/* Every 8th packet with a checksum the corner case */
+		if (rw != REWRITE_TTL && !d.udp_no_csum && !(i % 8) &&
+		    force_zero_csum(&d, &after)) {
+			memcpy(after.payload, d.payload, d.len);
+			zero_cases++;
+		}
+
+		len = build_pkt(in, &d, &sum);
+		build_pkt(expect, &after, &sum);
+
+		opts.data_size_in = len;
+		if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+			fprintf(stderr, "ERR: BPF_PROG_TEST_RUN: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		if (opts.retval != XDP_TX || opts.data_size_out != len ||
+		    memcmp(out, expect, len)) {
+			if (fails++ < 5) {
+				fprintf(stderr,
+					"FAIL %s: packet %d, IPv%d proto %d, retval %u\n",
+					prog_names[rw], i, d.ipv6 ? 6 : 4,
+					d.proto, opts.retval);
+				dump_pkt("in", in, len);
+				dump_pkt("out", out, opts.data_size_out);
+				dump_pkt("expect", expect, len);
+			}
+		}
+	}
+
+	printf("%-10s %d packets, %d with a resulting checksum of 0: %s\n",
+	       prog_names[rw], count, zero_cases, fails ? "FAIL" : "OK");
+	return fails;
+}
+
+/* Instruction count after the verifier's rewrites */
+static int xlated_insns(int prog_fd)
+{
+	struct bpf_prog_info info = {};
+	__u32 info_len = sizeof(info);
+
+	if (bpf_obj_get_info_by_fd(prog_fd, &info, &info_len))
+		return -1;
+	return info.xlated_prog_len / sizeof(struct bpf_insn);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "%s\nUsage: %s [-n packets] [-s seed] [bpf-object]\n",
+		__doc__, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *filename = "xdp_csum_kern.o";
+	int count = 100000, fails = 0, opt, map_fd;
+	unsigned int seed = time(NULL);
+	struct bpf_program *prog, *base;
+	struct bpf_object *obj;
+	char base_name[32];
+	enum rewrite rw;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "hn:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		filename = argv[optind];
+
+	obj = bpf_object__open_file(filename, NULL);
+	if (libbpf_get_error(obj)) {
+		fprintf(stderr, "ERR: opening %s\n", filename);
+		return EXIT_FAILURE;
+	}
+	if (bpf_object__load(obj)) {
+		fprintf(stderr, "ERR: loading %s\n", filename);
+		return EXIT_FAILURE;
+	}
+	map_fd = bpf_object__find_map_fd_by_name(obj, "csum_cfg_map");
+	if (map_fd < 0) {
+		fprintf(stderr, "ERR: no csum_cfg_map in %s\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	printf("seed %u\n", seed);
+	srandom(seed);
+	for (rw = 0; rw < REWRITE_MAX; rw++) {
+		prog = bpf_object__find_program_by_name(obj, prog_names[rw]);
+		if (!prog) {
+			fprintf(stderr, "ERR: no program %s\n", prog_names[rw]);
+			return EXIT_FAILURE;
+		}
+		ret = run_tests(bpf_program__fd(prog), map_fd, rw, count);
+		if (ret < 0)
+			return EXIT_FAILURE;
+		fails += ret;
+	}
+
+	printf("\n%-10s %8s %8s  %s\n", "program", "xlated", "helpers",
+	       "checksum update");
+	for (rw = 0; rw < REWRITE_MAX; rw++) {
+		int insns, base_insns;
+
+		snprintf(base_name, sizeof(base_name), "%s_base",
+			 prog_names[rw]);
+		prog = bpf_object__find_program_by_name(obj, prog_names[rw]);
+		base = bpf_object__find_program_by_name(obj, base_name);
+		if (!base) {
+			fprintf(stderr, "ERR: no program %s\n", base_name);
+			return EXIT_FAILURE;
+		}
+		insns = xlated_insns(bpf_program__fd(prog));
+		base_insns = xlated_insns(bpf_program__fd(base));
+		printf("%-10s %8d %+8d  %s\n", prog_names[rw], insns,
+		       insns - base_insns, helper_names[rw]);
+	}
+
+	bpf_object__close(obj);
+	return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
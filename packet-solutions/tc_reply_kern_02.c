@@ -9,6 +9,7 @@
 
 // The parsing helper functions from the packet01 lesson have moved here
 #include "../common/parsing_helpers.h"
+#include "../common/checksum_helpers.h"
 
 SEC("tc")
 int _fix_port_egress(struct __sk_buff *skb)
@@ -22,6 +23,7 @@ int _fix_port_egress(struct __sk_buff *skb)
         struct udphdr *udphdr;
         struct tcphdr *tcphdr;
 	struct ethhdr *eth;
+	__be16 old_port;
 
 	if (data + sizeof(*eth) > data_end)
 		goto out;
@@ -43,18 +45,18 @@ int _fix_port_egress(struct __sk_buff *skb)
 		if (parse_udphdr(&nh, data_end, &udphdr) < 0)
 			goto out;
 
+		old_port = udphdr->source;
 		udphdr->source = bpf_htons(bpf_ntohs(udphdr->source) + 1);
-		udphdr->check += bpf_htons(-1);
-		if (!udphdr->check)
-			udphdr->check += bpf_htons(-1);
+		l4_csum_replace2(&udphdr->check, IPPROTO_UDP, old_port,
+				 udphdr->source);
 	} else if (ip_type == IPPROTO_TCP) {
 		if (parse_tcphdr(&nh, data_end, &tcphdr) < 0)
 			goto out;
 
+		old_port = tcphdr->source;
 		tcphdr->source = bpf_htons(bpf_ntohs(tcphdr->source) + 1);
-		tcphdr->check += bpf_htons(-1);
-		if (!tcphdr->check)
-			tcphdr->check += bpf_htons(-1);
+		l4_csum_replace2(&tcphdr->check, IPPROTO_TCP, old_port,
+				 tcphdr->source);
 	}
 
 out:
@@ -27,6 +27,7 @@ int xdp_patch_ports_func(struct xdp_md *ctx)
 	struct ipv6hdr *ipv6hdr;
 	struct udphdr *udphdr;
 	struct tcphdr *tcphdr;
+	__be16 old_port;
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
 	struct hdr_cursor nh = { .pos = data };
@@ -53,31 +54,30 @@ int xdp_patch_ports_func(struct xdp_md *ctx)
 
 		/*
 		 * We need to update the packet checksum when modifying the header.
-		 * RFC1071 contains an algorithm for in-place updating, which is what we use here
-		 * since we're always just decrementing the port number. Another option would be
-		 * to recompute the full checksum, like:
+		 * RFC1624 has an algorithm for in-place updating, which is what
+		 * l4_csum_replace2() uses. Another option would be to recompute
+		 * the full checksum, like:
 		 *
 		 * struct udphdr udphdr_old;
 		 * __u32 csum = udphdr->check;
 		 * udphdr_old = *udphdr;
 		 * udphdr->dest = bpf_htons(bpf_ntohs(udphdr->dest) - 1);
 		 * csum = bpf_csum_diff((__be32 *)&udphdr_old, 4, (__be32 *)udphdr, 4, ~csum);
-		 * udphdr->check = csum_fold_helper(csum);
+		 * udphdr->check = csum_fold(csum);
 		 */
-
+		old_port = udphdr->dest;
 		udphdr->dest = bpf_htons(bpf_ntohs(udphdr->dest) - 1);
-		udphdr->check += bpf_htons(1);
-		if (!udphdr->check)
-			udphdr->check += bpf_htons(1);
+		l4_csum_replace2(&udphdr->check, IPPROTO_UDP, old_port,
+				 udphdr->dest);
 	} else if (ip_type == IPPROTO_TCP) {
 		if (parse_tcphdr(&nh, data_end, &tcphdr) < 0) {
 			action = XDP_ABORTED;
 			goto out;
 		}
+		old_port = tcphdr->dest;
 		tcphdr->dest = bpf_htons(bpf_ntohs(tcphdr->dest) - 1);
-		tcphdr->check += bpf_htons(1);
-		if (!tcphdr->check)
-			tcphdr->check += bpf_htons(1);
+		l4_csum_replace2(&tcphdr->check, IPPROTO_TCP, old_port,
+				 tcphdr->dest);
 	}
 
 out:
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+/* Outer headers for the re-encapsulated packets. With a len of 0 (the
+ * initial value) packets are only decapsulated.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct tunnel_encap);
+	__uint(max_entries, 1);
+} tunnel_encap_map SEC(".maps");
+
+/* Tunnel endpoint: strip the outer headers of VXLAN, GENEVE, GRE and IPIP
+ * packets and pass the inner packet to the stack, or, with a template in
+ * tunnel_encap_map, send it back out in a tunnel of its own.
+ */
+SEC("xdp")
+int xdp_tunnel(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct tunnel_encap *t;
+	struct pkt_meta meta;
+	__u32 key = 0;
+	int inner_type;
+
+	/* A fragment holds only part of the tunnel packet, which the kernel
+	 * has to reassemble first */
+	if (parse_pkt_meta(&nh, data_end, &meta) < 0 ||
+	    meta.flags & PKT_META_F_FRAG)
+		return XDP_PASS;
+
+	inner_type = parse_tunnel(&nh, data_end, meta.ip_proto, meta.dport);
+	if (inner_type < 0)
+		return XDP_PASS;
+
+	/* The helpers may have changed the packet when they fail, it can't
+	 * go anywhere after that */
+	if (tunnel_decap(ctx, nh.pos, inner_type))
+		return XDP_DROP;
+
+	t = bpf_map_lookup_elem(&tunnel_encap_map, &key);
+	if (!t || !t->len)
+		return XDP_PASS;
+
+	/* Keep the flows of the tunnel apart on the next hop, by the outer
+	 * source port of the packet as received */
+	if (tunnel_encap(ctx, t, meta.sport))
+		return XDP_DROP;
+
+	return XDP_TX;
+}
+
+char _license[] SEC("license") = "GPL";